@@ -0,0 +1,115 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+
+#include "access-log.hh"
+
+AccessLogWriter::AccessLogWriter(const std::string &p) :
+    path(p), tmpPath(p + ".tmp"), file(NULL), numKeys(0), failed(false) {
+}
+
+AccessLogWriter::~AccessLogWriter() {
+    abandon();
+}
+
+bool AccessLogWriter::open() {
+    abandon();
+    numKeys = 0;
+    failed = false;
+    file = fopen(tmpPath.c_str(), "wb");
+    if (file == NULL) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to create access log %s: %s\n",
+                         tmpPath.c_str(), strerror(errno));
+        return false;
+    }
+    if (fwrite(ACCESS_LOG_MAGIC, 1, strlen(ACCESS_LOG_MAGIC), file)
+        != strlen(ACCESS_LOG_MAGIC)) {
+        failed = true;
+    }
+    return true;
+}
+
+void AccessLogWriter::add(const char *key, size_t nkey) {
+    assert(file);
+    assert(nkey <= 0xffff);
+    unsigned char len[2];
+    len[0] = static_cast<unsigned char>(nkey >> 8);
+    len[1] = static_cast<unsigned char>(nkey & 0xff);
+    if (fwrite(len, 1, sizeof(len), file) != sizeof(len)
+        || fwrite(key, 1, nkey, file) != nkey) {
+        failed = true;
+    }
+    ++numKeys;
+}
+
+bool AccessLogWriter::commit() {
+    assert(file);
+    int rv = fclose(file);
+    file = NULL;
+    if (failed || rv != 0) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to write access log %s\n", tmpPath.c_str());
+        remove(tmpPath.c_str());
+        return false;
+    }
+    if (rename(tmpPath.c_str(), path.c_str()) != 0) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to replace access log %s: %s\n",
+                         path.c_str(), strerror(errno));
+        remove(tmpPath.c_str());
+        return false;
+    }
+    return true;
+}
+
+void AccessLogWriter::abandon() {
+    if (file != NULL) {
+        fclose(file);
+        file = NULL;
+        remove(tmpPath.c_str());
+    }
+}
+
+AccessLogReader::AccessLogReader(const std::string &p) : path(p), file(NULL) {
+}
+
+AccessLogReader::~AccessLogReader() {
+    if (file != NULL) {
+        fclose(file);
+    }
+}
+
+bool AccessLogReader::open() {
+    assert(file == NULL);
+    file = fopen(path.c_str(), "rb");
+    if (file == NULL) {
+        return false;
+    }
+    char magic[sizeof(ACCESS_LOG_MAGIC)];
+    size_t n = strlen(ACCESS_LOG_MAGIC);
+    if (fread(magic, 1, n, file) != n || memcmp(magic, ACCESS_LOG_MAGIC, n) != 0) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "%s is not an access log; ignoring it\n",
+                         path.c_str());
+        fclose(file);
+        file = NULL;
+        return false;
+    }
+    return true;
+}
+
+bool AccessLogReader::next(std::string &key) {
+    assert(file);
+    unsigned char len[2];
+    if (fread(len, 1, sizeof(len), file) != sizeof(len)) {
+        return false;
+    }
+    size_t nkey = (static_cast<size_t>(len[0]) << 8) | len[1];
+    key.resize(nkey);
+    if (nkey > 0 && fread(&key[0], 1, nkey, file) != nkey) {
+        return false;
+    }
+    return true;
+}
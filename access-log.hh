@@ -0,0 +1,93 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef ACCESS_LOG_HH
+#define ACCESS_LOG_HH 1
+
+#include <stdio.h>
+#include <string>
+
+#include "common.hh"
+
+/*
+ * An access log lists the keys of the items that were in memory and
+ * in use when it was written, for warmup to load before the rest.
+ *
+ * The file starts with ACCESS_LOG_MAGIC; each key follows as a two
+ * byte big-endian length and the key's bytes.
+ */
+#define ACCESS_LOG_MAGIC "ep-access-log-1\n"
+
+/**
+ * Writes an access log.  The keys go to a temporary file that only
+ * replaces the old log once commit() succeeds, so a crash part way
+ * through leaves the previous log in place.
+ */
+class AccessLogWriter {
+public:
+    AccessLogWriter(const std::string &p);
+
+    // Throws away the log if it wasn't committed.
+    ~AccessLogWriter();
+
+    /**
+     * Start a new log.
+     *
+     * @return false if the temporary file couldn't be created
+     */
+    bool open();
+
+    void add(const char *key, size_t nkey);
+
+    /**
+     * Replace the old log with the keys added since open().
+     *
+     * @return false if the log couldn't be written
+     */
+    bool commit();
+
+    size_t getNumKeys() const {
+        return numKeys;
+    }
+
+private:
+    void abandon();
+
+    std::string path;
+    std::string tmpPath;
+    FILE       *file;
+    size_t      numKeys;
+    bool        failed;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogWriter);
+};
+
+/**
+ * Reads back the keys of an access log in the order they were
+ * written.
+ */
+class AccessLogReader {
+public:
+    AccessLogReader(const std::string &p);
+
+    ~AccessLogReader();
+
+    /**
+     * @return false if there's no log at the path, or the file there
+     *         isn't one
+     */
+    bool open();
+
+    /**
+     * Read the next key.
+     *
+     * @return false at the end of the log, or at a key cut short
+     */
+    bool next(std::string &key);
+
+private:
+    std::string path;
+    FILE       *file;
+
+    DISALLOW_COPY_AND_ASSIGN(AccessLogReader);
+};
+
+#endif /* ACCESS_LOG_HH */
@@ -30,6 +30,10 @@ using SHARED_PTR_NAMESPACE::shared_ptr;
     TypeName(const TypeName&);                  \
     void operator=(const TypeName&)
 
+// Size to pad frequently written objects to so neighbours in an array
+// don't share (and fight over) a cache line.
+#define CACHE_LINE_SIZE 64
+
 // Utility functions implemented in various modules.
 extern EXTENSION_LOGGER_DESCRIPTOR *getLogger(void);
 
@@ -52,4 +56,13 @@ inline bool less_tv(const struct timeval &tv1, const struct timeval &tv2) {
     }
 }
 
+// Microseconds elapsed since the given time.
+inline uint64_t usec_since(const struct timeval &start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    int64_t usec = (static_cast<int64_t>(now.tv_sec - start.tv_sec) * 1000000)
+        + (now.tv_usec - start.tv_usec);
+    return usec > 0 ? static_cast<uint64_t>(usec) : 0;
+}
+
 #endif /* COMMON_H */
@@ -1,13 +1,25 @@
 #include "dispatcher.hh"
 
+namespace {
+    // A worker thread's dispatcher and the class of tasks it prefers.
+    struct Worker {
+        Worker(Dispatcher *d, task_class c) : dispatcher(d), cls(c) { }
+        Dispatcher *dispatcher;
+        task_class  cls;
+    };
+}
+
 extern "C" {
     static void* launch_dispatcher_thread(void* arg);
 }
 
 static void* launch_dispatcher_thread(void *arg) {
-    Dispatcher *dispatcher = (Dispatcher*) arg;
+    Worker *worker = static_cast<Worker*>(arg);
+    Dispatcher *dispatcher = worker->dispatcher;
+    task_class cls = worker->cls;
+    delete worker;
     try {
-        dispatcher->run();
+        dispatcher->run(cls);
     } catch (std::exception& e) {
         getLogger()->log(EXTENSION_LOG_WARNING, NULL, "dispatcher exception caught: %s\n",
                          e.what());
@@ -18,8 +30,216 @@ static void* launch_dispatcher_thread(void *arg) {
     return NULL;
 }
 
+task_class Dispatcher::workerClass(size_t worker) {
+    static const task_class classes[] = {
+        task_class_write, task_class_nonio, task_class_read
+    };
+    return worker < TASK_CLASSES ? classes[worker] : task_class_write;
+}
+
 void Dispatcher::start() {
-    if(pthread_create(&thread, NULL, launch_dispatcher_thread, this) != 0) {
-        throw std::runtime_error("Error initializing dispatcher thread");
+    for (size_t i = 0; i < numWorkers; ++i) {
+        pthread_t thread;
+        Worker *worker = new Worker(this, workerClass(i));
+        if (pthread_create(&thread, NULL, launch_dispatcher_thread, worker) != 0) {
+            delete worker;
+            throw std::runtime_error("Error initializing dispatcher thread");
+        }
+        threads.push_back(thread);
+    }
+}
+
+void Dispatcher::run(task_class cls) {
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher starting\n");
+    LockHolder lh(mutex);
+    while (state == dispatcher_running) {
+        struct timeval waketime;
+        bool sleeping(false);
+        TaskId task = nextTask(cls, waketime, sleeping);
+        if (task) {
+            lh.unlock();
+            bool again(false);
+            try {
+                again = task->run(*this, TaskId(task));
+            } catch (std::exception& e) {
+                std::cerr << "exception caught in task " << task->name << ": " << e.what() << std::endl;
+            } catch(...) {
+                std::cerr << "Caught a fatal exception in task" << task->name <<std::endl;
+            }
+            lh.lock();
+            done(task, again);
+        } else if (sleeping) {
+            mutex.wait(waketime);
+        } else {
+            // Wait forever
+            mutex.wait();
+        }
+    }
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher exited\n");
+}
+
+/**
+ * Take the next task a worker of the given class can run: the one of
+ * highest priority among its own class and the lighter ones, its own
+ * class first among equals.  Caller must hold the dispatcher's mutex.
+ *
+ * @return the task, or an empty TaskId with sleeping set if the
+ *         earliest of the sleeping ones is due at waketime
+ */
+TaskId Dispatcher::nextTask(task_class cls, struct timeval &waketime,
+                            bool &sleeping) {
+    if (cancelled) {
+        cancelled = false;
+        for (int c = 0; c < TASK_CLASSES; ++c) {
+            dropCancelled(queues[c]);
+        }
+    }
+
+    int best = -1;
+    for (int c = cls; c >= 0; --c) {
+        if (!runnableTop(queues[c], waketime, sleeping)) {
+            continue;
+        }
+        if (best < 0 || queues[c].top()->priority < queues[best].top()->priority) {
+            best = c;
+        }
+    }
+    if (best < 0) {
+        return TaskId();
+    }
+    TaskId task = queues[best].top();
+    queues[best].pop();
+    if (task->handedSerial) {
+        task->handedSerial = false;
+    } else if (task->serial != NULL) {
+        running[task->serial];
+    }
+    return task;
+}
+
+/**
+ * Rebuild a queue without its cancelled tasks.  A sleeping task that's
+ * cancelled keeps its place in the queue though it now sorts ahead of
+ * the sleeping ones, so the tasks under it could be hidden behind a
+ * sleeping task until that one was due.  Caller must hold the
+ * dispatcher's mutex.
+ */
+void Dispatcher::dropCancelled(TaskQueue &queue) {
+    std::vector<TaskId> live;
+    while (!queue.empty()) {
+        TaskId task = queue.top();
+        queue.pop();
+        LockHolder tlh(task->mutex);
+        if (task->state != task_dead) {
+            live.push_back(task);
+        } else if (task->handedSerial) {
+            task->handedSerial = false;
+            tlh.unlock();
+            releaseSerial(task);
+        }
+    }
+    std::vector<TaskId>::iterator it;
+    for (it = live.begin(); it != live.end(); ++it) {
+        queue.push(*it);
+    }
+}
+
+/**
+ * Clear the tasks that can't run now off the top of a queue: dropping
+ * the dead ones and setting aside those whose serial is busy.  Caller
+ * must hold the dispatcher's mutex.
+ *
+ * @return true if the task left on top can run now; otherwise if it's
+ *         asleep, waketime is brought forward to when it's due
+ */
+bool Dispatcher::runnableTop(TaskQueue &queue, struct timeval &waketime,
+                             bool &sleeping) {
+    while (!queue.empty()) {
+        TaskId task = queue.top();
+        LockHolder tlh(task->mutex);
+        if (task->state == task_sleeping) {
+            struct timeval tv;
+            gettimeofday(&tv, NULL);
+            if (less_tv(tv, task->waketime)) {
+                if (!sleeping || less_tv(task->waketime, waketime)) {
+                    waketime = task->waketime;
+                    sleeping = true;
+                }
+                return false;
+            }
+            task->state = task_running;
+        }
+        if (task->state == task_dead) {
+            queue.pop();
+            if (task->handedSerial) {
+                task->handedSerial = false;
+                releaseSerial(task);
+            }
+            continue;
+        }
+        if (task->serial != NULL && !task->handedSerial) {
+            std::map<const void*, std::vector<TaskId> >::iterator it;
+            it = running.find(task->serial);
+            if (it != running.end()) {
+                queue.pop();
+                it->second.push_back(task);
+                continue;
+            }
+        }
+        return true;
+    }
+    return false;
+}
+
+/**
+ * Put back a task that has run, along with any it held up.  Caller
+ * must hold the dispatcher's mutex.
+ */
+void Dispatcher::done(TaskId task, bool reschedule) {
+    if (task->serial != NULL) {
+        releaseSerial(task);
+    }
+    // If the task is already in the queue it'll get run twice
+    if (reschedule) {
+        queues[task->cls].push(task);
+    }
+    mutex.notify();
+}
+
+/**
+ * Hand a task's serial to the first of the tasks it held up, or free
+ * it if there are none.  Caller must hold the dispatcher's mutex.
+ */
+void Dispatcher::releaseSerial(TaskId task) {
+    std::map<const void*, std::vector<TaskId> >::iterator it;
+    it = running.find(task->serial);
+    assert(it != running.end());
+    std::vector<TaskId> &held = it->second;
+    if (held.empty()) {
+        running.erase(it);
+    } else {
+        TaskId next = held.front();
+        held.erase(held.begin());
+        next->handedSerial = true;
+        queues[next->cls].push(next);
+    }
+}
+
+void Dispatcher::stop() {
+    LockHolder lh(mutex);
+    if (state == dispatcher_stopped) {
+        return;
+    }
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Stopping dispatcher\n");
+    state = dispatcher_stopping;
+    mutex.notify();
+    lh.unlock();
+    std::vector<pthread_t>::iterator it;
+    for (it = threads.begin(); it != threads.end(); ++it) {
+        pthread_join(*it, NULL);
     }
+    threads.clear();
+    lh.lock();
+    state = dispatcher_stopped;
+    getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher stopped\n");
 }
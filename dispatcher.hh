@@ -2,8 +2,11 @@
 #ifndef DISPATCHER_HH
 #define DISPATCHER_HH
 
+#include <assert.h>
 #include <stdexcept>
 #include <queue>
+#include <map>
+#include <vector>
 
 #include "common.hh"
 #include "locks.hh"
@@ -16,6 +19,19 @@ enum task_state {
     task_sleeping
 };
 
+/**
+ * What a task spends its time on.  Each worker thread has a class of
+ * its own and only runs tasks of that class or of a lighter one, so
+ * there's always a worker that no flush can hold up.
+ */
+enum task_class {
+    task_class_nonio,           // In memory only; short.
+    task_class_read,            // Reads from disk.
+    task_class_write            // Writes to disk; may be long.
+};
+
+#define TASK_CLASSES 3
+
 enum dispatcher_state {
     dispatcher_running,
     dispatcher_stopping,
@@ -23,8 +39,11 @@ enum dispatcher_state {
 };
 
 class Task;
+class CompareTasks;
 
 typedef shared_ptr<Task> TaskId;
+typedef std::priority_queue<TaskId, std::deque<TaskId>,
+                            CompareTasks> TaskQueue;
 
 class DispatcherCallback {
 public:
@@ -32,24 +51,25 @@ public:
     virtual bool callback(Dispatcher &d, TaskId t) = 0;
 };
 
-class CompareTasks;
-
 class Task {
 friend class CompareTasks;
 public:
     ~Task() { }
 private:
-    Task(shared_ptr<DispatcherCallback> cb, int p=0, double sleeptime=0) :
-         callback(cb), priority(p) {
+    Task(shared_ptr<DispatcherCallback> cb, int p=0, double sleeptime=0,
+         task_class c=task_class_nonio, const void *s=NULL) :
+         callback(cb), priority(p), cls(c), serial(s), handedSerial(false),
+         state(task_running) {
         if (sleeptime > 0) {
             snooze(sleeptime);
-        } else {
-            state = task_running;
         }
     }
 
     Task(const Task &task) {
         priority = task.priority;
+        cls = task.cls;
+        serial = task.serial;
+        handedSerial = false;
         state = task_running;
         callback = task.callback;
     }
@@ -58,7 +78,10 @@ private:
         LockHolder lh(mutex);
         gettimeofday(&waketime, NULL);
         advance_tv(waketime, secs);
-        state = task_sleeping;
+        // A task cancelled while it ran stays cancelled.
+        if (state != task_dead) {
+            state = task_sleeping;
+        }
     }
 
     bool run(Dispatcher &d, TaskId t) {
@@ -75,6 +98,12 @@ private:
     struct timeval waketime;
     shared_ptr<DispatcherCallback> callback;
     int priority;
+    task_class cls;
+    // Tasks with the same serial never run at the same time.
+    const void *serial;
+    // Whether the task it waited for handed it the serial, so it may
+    // run though the serial is taken.
+    bool handedSerial;
     enum task_state state;
     Mutex mutex;
 };
@@ -82,132 +111,129 @@ private:
 class CompareTasks {
 public:
     bool operator()(TaskId t1, TaskId t2) {
-        if (t1->state == task_running) {
-            if (t2->state == task_running) {
-                return t1->priority > t2->priority;
-            } else if (t2->state == task_sleeping) {
-                return false;
-            }
-        } else if (t1->state == task_sleeping && t2->state == task_sleeping) {
+        // Sleeping tasks come after the others (dead ones included, so
+        // they're dropped soon), in order of waketime.
+        bool asleep1 = t1->state == task_sleeping;
+        bool asleep2 = t2->state == task_sleeping;
+        if (asleep1 != asleep2) {
+            return asleep1;
+        } else if (asleep1) {
             return less_tv(t2->waketime, t1->waketime);
         }
-        return true;
+        return t1->priority > t2->priority;
     }
 };
 
+/**
+ * Runs scheduled tasks on a pool of worker threads.
+ *
+ * Tasks are queued by class, each queue in order of priority and then
+ * of waketime.  A worker runs tasks of its own class and also those of
+ * lighter classes, taking the runnable one of highest priority and its
+ * own class's first among equals; it never takes a task of a heavier
+ * class.  This isn't work stealing: there are no per-worker queues,
+ * only the shared per-class ones, and every worker takes its tasks
+ * under the dispatcher's one mutex.
+ * The first worker runs writes (and so everything, if it's the only
+ * one), the second non-IO tasks and the third reads; any more run
+ * writes.
+ *
+ * Tasks that share a connection or anything else that mustn't be used
+ * from two threads at once pass the same serial; one that comes up
+ * while another with its serial runs is set aside, and the serial is
+ * handed to the tasks set aside in turn, so one that keeps running
+ * can't shut the others out.
+ */
 class Dispatcher {
 public:
-    Dispatcher() : state(dispatcher_running) { }
+    Dispatcher(size_t n=1) : cancelled(false), state(dispatcher_running),
+                             numWorkers(n) {
+        assert(numWorkers > 0);
+    }
 
     ~Dispatcher() {
         stop();
     }
 
     TaskId schedule(shared_ptr<DispatcherCallback> callback, int priority=0,
-                    double sleeptime=0) {
+                    double sleeptime=0, task_class cls=task_class_nonio,
+                    const void *serial=NULL) {
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Scheduling a new task\n");
         LockHolder lh(mutex);
-        TaskId task(new Task(callback, priority, sleeptime));
-        queue.push(task);
+        TaskId task(new Task(callback, priority, sleeptime, cls, serial));
+        queues[cls].push(task);
         mutex.notify();
         return TaskId(task);
     }
 
+    /**
+     * Run a task now rather than when it was due.
+     *
+     * @return the task that replaces it, to cancel or wake later
+     */
     TaskId wake(TaskId task) {
-        cancel(task);
+        LockHolder lh(mutex);
+        unlocked_cancel(task);
         TaskId oldTask(task);
         TaskId newTask(new Task(*oldTask));
-        queue.push(newTask);
+        queues[newTask->cls].push(newTask);
         mutex.notify();
         return TaskId(newTask);
     }
 
     void start();
 
-    void run() {
-        getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher starting\n");
-        while (state == dispatcher_running) {
-            LockHolder lh(mutex);
-            if (queue.empty()) {
-                // Wait forever
-                mutex.wait();
-            } else {
-                TaskId task = queue.top();
-                LockHolder tlh(task->mutex);
-                switch (task->state) {
-                case task_sleeping:
-                    {
-                        struct timeval tv;
-                        gettimeofday(&tv, NULL);
-                        if (less_tv(tv, task->waketime)) {
-                            tlh.unlock();
-                            mutex.wait(task->waketime);
-                        } else {
-                            task->state = task_running;
-                        }
-                    }
-                    break;
-                case task_running:
-                    queue.pop();
-                    lh.unlock();
-                    tlh.unlock();
-                    try {
-                        if(task->run(*this, TaskId(task))) {
-                            reschedule(task);
-                        }
-                    } catch (std::exception& e) {
-                        std::cerr << "exception caught in task " << task->name << ": " << e.what() << std::endl;
-                    } catch(...) {
-                        std::cerr << "Caught a fatal exception in task" << task->name <<std::endl;
-                    }
-                    break;
-                case task_dead:
-                    queue.pop();
-                    break;
-                default:
-                    throw std::runtime_error("Unexpected state for task");
-                }
-            }
-        }
+    // Work through the tasks as a worker of the given class.
+    void run(task_class cls);
 
-        state = dispatcher_stopped;
-        mutex.notify();
-        getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher exited\n");
-    }
-
-    void stop() {
-        LockHolder lh(mutex);
-        if (state == dispatcher_stopped) {
-            return;
-        }
-        getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Stopping dispatcher\n");
-        state = dispatcher_stopping;
-        mutex.notify();
-        lh.unlock();
-        pthread_join(thread, NULL);
-        getLogger()->log(EXTENSION_LOG_DEBUG, NULL, "Dispatcher stopped\n");
-    }
+    void stop();
 
     void snooze(TaskId t, double sleeptime) {
         t->snooze(sleeptime);
     }
 
     void cancel(TaskId t) {
-        t->cancel();
+        LockHolder lh(mutex);
+        unlocked_cancel(t);
     }
 
+    size_t getNumWorkers() const {
+        return numWorkers;
+    }
+
+    // The class of tasks the given worker prefers.
+    static task_class workerClass(size_t worker);
+
 private:
-    void reschedule(TaskId task) {
-        // If the task is already in the queue it'll get run twice
-        LockHolder lh(mutex);
-        queue.push(task);
+    // Caller must hold the dispatcher's mutex.
+    void unlocked_cancel(TaskId t) {
+        t->cancel();
+        cancelled = true;
     }
 
-    pthread_t thread;
+    void dropCancelled(TaskQueue &queue);
+
+    TaskId nextTask(task_class cls, struct timeval &waketime,
+                    bool &sleeping);
+
+    bool runnableTop(TaskQueue &queue, struct timeval &waketime,
+                     bool &sleeping);
+
+    void done(TaskId task, bool reschedule);
+
+    void releaseSerial(TaskId task);
+
+    std::vector<pthread_t> threads;
     SyncObject mutex;
-    std::priority_queue<TaskId, std::deque<TaskId >,
-                        CompareTasks> queue;
+    TaskQueue queues[TASK_CLASSES];
+    // The serials of the running tasks, and the tasks set aside until
+    // each is done.
+    std::map<const void*, std::vector<TaskId> > running;
+    // Whether a task has been cancelled, perhaps where it waited in a
+    // queue, since the queues were last cleared of them.
+    bool cancelled;
     enum dispatcher_state state;
+    size_t numWorkers;
 };
 
 #endif
@@ -3,7 +3,10 @@
 #include "flusher.hh"
 #include "locks.hh"
 #include "dispatcher.hh"
+#include "access-log.hh"
 
+#include <algorithm>
+#include <sstream>
 #include <vector>
 #include <time.h>
 #include <string.h>
@@ -18,23 +21,107 @@ extern "C" {
 }
 
 EventuallyPersistentStore::EventuallyPersistentStore(KVStore *t,
+                                                     hash_table_layout_t htLayout,
+                                                     hash_table_lock_t htLockType,
+                                                     size_t htLocks,
+                                                     const std::vector<KVStore*> &shardStores,
+                                                     warmup_mode_t wm,
+                                                     const std::string &al,
+                                                     bool lr,
+                                                     size_t dispatcherThreads,
                                                      size_t est) :
-    loadStorageKVPairCallback(storage, stats)
+    warmupMode(wm), accessLog(al), loadRest(lr),
+    storage(DEFAULT_HT_SIZE, htLocks, htLayout, htLockType)
 {
     est_size = est;
     stats.min_data_age.set(DEFAULT_MIN_DATA_AGE);
     stats.queue_age_cap.set(DEFAULT_MIN_DATA_AGE_CAP);
+    stats.numValueEjects.set(0);
+    stats.bgFetched.set(0);
+    stats.bgFetchCoalesced.set(0);
+    stats.missFetched.set(0);
+    stats.bgFetchFailed.set(0);
+    stats.curr_items.set(0);
+    stats.warmedUp.set(0);
+    stats.keysLoaded.set(false);
+    stats.backgroundLoaded.set(0);
+    stats.accessScannerRuns.set(0);
+    stats.accessLogKeys.set(0);
+    stats.access_log_interval.set(DEFAULT_ACCESS_LOG_INTERVAL);
+    stats.persistWaiting.set(0);
+    stats.queue_high_wat.set(0);
+    stats.queue_low_wat.set(0);
+    stats.dirty_high_wat.set(0);
+    stats.dirty_low_wat.set(0);
+    stats.throttlePeriods.set(0);
+    stats.checkpoints.set(0);
+    stats.checkpointTimeMs.set(0);
+    stats.checkpoint_interval.set(DEFAULT_CHECKPOINT_INTERVAL);
+    stats.throttledWrites.set(0);
+    writesThrottled.set(false);
+    stats.persistNotified.set(0);
+    stats.expired.set(0);
+    stats.expiryPagerExpired.set(0);
+    stats.expiryPagerRuns.set(0);
+    stats.expiryPagerStripesDone.set(0);
+    stats.exp_pager_stime.set(DEFAULT_EXP_PAGER_STIME);
+    stats.txn_commit_target.set(DEFAULT_TXN_COMMIT_TARGET);
+    stats.txnSize.set(0);
+    stats.commitTimeMs.set(0);
+    stats.warmupComplete.set(false);
+    stats.queue_size.set(0);
+    stats.flusher_todo.set(0);
+    notifyIOComplete = NULL;
+    setMaxDataSize(0);
 
     doPersistence = getenv("EP_NO_PERSISTENCE") == NULL;
-    dispatcher = new Dispatcher();
-    flusher = new Flusher(this, dispatcher);
 
     setTxnSize(DEFAULT_TXN_SIZE);
+    setSortFlushBatches(true);
 
     underlying = t;
 
-    startDispatcher();
+    if (shardStores.empty()) {
+        shards.push_back(new PersistenceShard(underlying));
+    } else {
+        std::vector<KVStore*>::const_iterator it;
+        for (it = shardStores.begin(); it != shardStores.end(); ++it) {
+            shards.push_back(new PersistenceShard(*it));
+        }
+    }
+    shardsWarmingUp.set(shards.size());
+    warmupStart = time(NULL);
+    AccessLogReader log(accessLog);
+    warmupFromAccessLog = warmupMode != WARMUP_NONE && !accessLog.empty()
+        && log.open();
+    shardsLoading.set(warmupFromAccessLog && loadRest ? shards.size() : 0);
+    if (dispatcherThreads == 0) {
+        dispatcherThreads = shards.size() + TASK_CLASSES - 1;
+    }
+    dispatcher = new Dispatcher(dispatcherThreads);
+    for (size_t i = 0; i < shards.size(); ++i) {
+        shards[i]->flusher = new Flusher(this, dispatcher, shards[i]);
+    }
+
+    // Schedule the flushers before the dispatcher runs them, so each
+    // knows its task by the time it first steps.
     startFlusher();
+    startDispatcher();
+    for (size_t i = 0; i < shards.size(); ++i) {
+        dispatcher->schedule(shared_ptr<Checkpointer>(new Checkpointer(this, shards[i])),
+                             0, DEFAULT_CHECKPOINT_INTERVAL, task_class_write,
+                             shards[i]->store);
+    }
+    dispatcher->schedule(shared_ptr<HashTableResizer>(new HashTableResizer(this)),
+                         0, HT_RESIZE_INTERVAL);
+    dispatcher->schedule(shared_ptr<ItemPager>(new ItemPager(this)),
+                         0, ITEM_PAGER_INTERVAL);
+    // The first pass finds an empty table and then sleeps for the
+    // configured exp_pager_stime.
+    dispatcher->schedule(shared_ptr<ExpiredItemPager>(new ExpiredItemPager(this)));
+    if (!accessLog.empty()) {
+        dispatcher->schedule(shared_ptr<AccessScanner>(new AccessScanner(this)));
+    }
     assert(underlying);
 }
 
@@ -69,7 +156,11 @@ EventuallyPersistentStore::~EventuallyPersistentStore() {
         }
     }
 
-    delete flusher;
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        delete (*it)->flusher;
+        delete *it;
+    }
     delete dispatcher;
 }
 
@@ -79,57 +170,287 @@ void EventuallyPersistentStore::startDispatcher() {
 
 
 const Flusher* EventuallyPersistentStore::getFlusher() {
-    return flusher;
+    return shards[0]->flusher;
 }
 
 void EventuallyPersistentStore::startFlusher() {
-    flusher->start();
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        (*it)->flusher->start();
+    }
 }
 
 void EventuallyPersistentStore::stopFlusher() {
-    bool rv = flusher->stop();
-    if (rv) {
-        flusher->wait();
+    // Stop them all before waiting, so they write out their queues
+    // in parallel.
+    std::vector<Flusher*> stopping;
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        if ((*it)->flusher->stop()) {
+            stopping.push_back((*it)->flusher);
+        }
+    }
+    std::vector<Flusher*>::iterator fit;
+    for (fit = stopping.begin(); fit != stopping.end(); ++fit) {
+        (*fit)->wait();
     }
 }
 
 bool EventuallyPersistentStore::pauseFlusher() {
-    flusher->pause();
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        (*it)->flusher->pause();
+    }
     return true;
 }
 
 bool EventuallyPersistentStore::resumeFlusher() {
-    flusher->resume();
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        (*it)->flusher->resume();
+    }
+    return true;
+}
+
+bool HashTableResizer::callback(Dispatcher &d, TaskId t) {
+    HashTable &ht = store->storage;
+    if (ht.isResizing()) {
+        if (ht.resizeStep(HT_RESIZE_STEP_SIZE)) {
+            d.snooze(t, HT_RESIZE_STEP_INTERVAL);
+            return true;
+        }
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Hash table resized to %d buckets\n",
+                         (int)ht.getSize());
+    } else {
+        size_t from = ht.getSize();
+        size_t to = ht.getTargetSize();
+        if (to != from && ht.resize(to)) {
+            getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                             "Resizing hash table from %d to %d buckets\n",
+                             (int)from, (int)ht.getSize());
+            d.snooze(t, HT_RESIZE_STEP_INTERVAL);
+            return true;
+        }
+    }
+    d.snooze(t, HT_RESIZE_INTERVAL);
+    return true;
+}
+
+/**
+ * Ejects values as it walks the hash table until memory use is below
+ * the given watermark.
+ */
+class PagingVisitor : public HashTableVisitor {
+public:
+    PagingVisitor(HashTable &h, size_t lowWat) :
+        ht(h), lowWatermark(lowWat), ejected(0) { }
+
+    void visit(StoredValue *v) {
+        if (ht.getMemSize() > lowWatermark && ht.unlocked_ejectValue(v)) {
+            ++ejected;
+        }
+    }
+
+    bool shouldContinue() {
+        return ht.getMemSize() > lowWatermark;
+    }
+
+    HashTable &ht;
+    size_t     lowWatermark;
+    size_t     ejected;
+};
+
+bool ItemPager::callback(Dispatcher &d, TaskId t) {
+    HashTable &ht = store->storage;
+    EPStats &stats = store->stats;
+    size_t highWat = stats.mem_high_wat.get();
+    if (highWat > 0 && ht.getMemSize() > highWat) {
+        size_t before = ht.getMemSize();
+        PagingVisitor pv(ht, stats.mem_low_wat.get());
+        ht.visit(pv);
+        stats.numValueEjects.incr(pv.ejected);
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Ejected %d values, memory use went from %d to %d\n",
+                         (int)pv.ejected, (int)before, (int)ht.getMemSize());
+    }
+    d.snooze(t, ITEM_PAGER_INTERVAL);
+    return true;
+}
+
+/**
+ * Collects the keys of expired items, which can't be removed while
+ * the hash table is being walked.
+ */
+class ExpiredVisitor : public HashTableVisitor {
+public:
+    ExpiredVisitor(rel_time_t t) : now(t) { }
+
+    void visit(StoredValue *v) {
+        if (v->isExpired(now)) {
+            expired.push_back(std::make_pair(v->getKey(), v->getHash()));
+        }
+    }
+
+    rel_time_t                                     now;
+    std::vector<std::pair<std::string, uint64_t> > expired;
+};
+
+bool ExpiredItemPager::callback(Dispatcher &d, TaskId t) {
+    HashTable &ht = store->storage;
+    EPStats &stats = store->stats;
+    ExpiredVisitor ev(ep_current_time());
+    for (size_t n = 0; n < EXP_PAGER_STRIPES_PER_STEP
+             && stripe < ht.getNumLocks(); ++n, ++stripe) {
+        ht.visitStripe(stripe, ev);
+    }
+
+    size_t before = stats.expired.get();
+    std::vector<std::pair<std::string, uint64_t> >::iterator it;
+    for (it = ev.expired.begin(); it != ev.expired.end(); ++it) {
+        store->expire(it->first, it->second);
+    }
+    stats.expiryPagerExpired.incr(stats.expired.get() - before);
+    stats.expiryPagerStripesDone.set(stripe);
+
+    if (stripe < ht.getNumLocks()) {
+        d.snooze(t, EXP_PAGER_STEP_INTERVAL);
+    } else {
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Expiry pager pass complete, %d items expired so far\n",
+                         (int)stats.expiryPagerExpired.get());
+        stripe = 0;
+        stats.expiryPagerRuns.incr();
+        d.snooze(t, stats.exp_pager_stime.get());
+    }
+    return true;
+}
+
+bool Checkpointer::callback(Dispatcher &d, TaskId t) {
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    if (!shard->store->checkpoint()) {
+        // Not in WAL mode; there's nothing to checkpoint.
+        return false;
+    }
+    store->stats.checkpointTimeMs.set(usec_since(start) / 1000);
+    store->stats.checkpoints.incr();
+    d.snooze(t, store->stats.checkpoint_interval.get());
+    return true;
+}
+
+/**
+ * Collects the keys of the resident items used since the access
+ * scanner last ran, and clears their marks for the next run.
+ */
+class ReferencedVisitor : public HashTableVisitor {
+public:
+    void visit(StoredValue *v) {
+        if (v->isReferenced()) {
+            if (v->isResident()) {
+                keys.push_back(v->getKey());
+            }
+            v->clearReferenced();
+        }
+    }
+
+    std::vector<std::string> keys;
+};
+
+bool AccessScanner::callback(Dispatcher &d, TaskId t) {
+    EPStats &stats = store->stats;
+    if (!stats.warmupComplete.get()) {
+        // Leave the log alone while warmup may be reading it.
+        d.snooze(t, 1);
+        return true;
+    }
+
+    // Once warmup is done, give the items a full interval to be used
+    // before writing them out.
+    if (runs++ > 0) {
+        HashTable &ht = store->storage;
+        AccessLogWriter log(store->accessLog);
+        if (log.open()) {
+            ReferencedVisitor rv;
+            for (size_t i = 0; i < ht.getNumLocks(); ++i) {
+                ht.visitStripe(i, rv);
+                std::vector<std::string>::iterator it;
+                for (it = rv.keys.begin(); it != rv.keys.end(); ++it) {
+                    log.add(it->data(), it->size());
+                }
+                rv.keys.clear();
+            }
+            // Nothing was used this interval; an empty log would only
+            // throw away what the last one knew, so keep that instead.
+            if (log.getNumKeys() > 0 && log.commit()) {
+                stats.accessLogKeys.set(log.getNumKeys());
+                stats.accessScannerRuns.incr();
+                getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                                 "Wrote %d keys to the access log\n",
+                                 (int)log.getNumKeys());
+            }
+        }
+    }
+    d.snooze(t, stats.access_log_interval.get());
     return true;
 }
 
+bool BackgroundLoader::callback(Dispatcher &d, TaskId t) {
+    if (store->loadSome(*shard, position)) {
+        d.snooze(t, BACKGROUND_LOAD_STEP_INTERVAL);
+        return true;
+    }
+    return false;
+}
+
+bool BGFetchCallback::callback(Dispatcher &d, TaskId t) {
+    if (!store->completeBGFetch(key, hash, ++reads < BG_FETCH_MAX_READS)) {
+        d.snooze(t, BG_FETCH_RETRY_INTERVAL);
+        return true;
+    }
+    return false;
+}
+
 void EventuallyPersistentStore::set(const Item &item, Callback<bool> &cb) {
-    mutation_type_t mtype = storage.set(item);
+    StripeLockHolder lh(storage.getStripeLock(item.getHash()));
+    StoredValue *v = NULL;
+    mutation_type_t mtype = storage.unlocked_set(item, &v);
     bool rv = true;
 
     if (mtype == INVALID_CAS || mtype == IS_LOCKED) {
         rv = false;
-    } else if (mtype == WAS_CLEAN || mtype == NOT_FOUND) {
-        queueDirty(item.getKey());
+    } else {
+        v->markReferenced();
+        unlocked_queueDirty(v);
         if (mtype == NOT_FOUND) {
             stats.curr_items.incr();
         }
     }
+    lh.unlock();
 
     cb.setStatus((int)mtype);
     cb.callback(rv);
 }
 
-void EventuallyPersistentStore::get(const std::string &key,
+void EventuallyPersistentStore::get(const std::string &key, uint64_t hash,
                                     Callback<GetValue> &cb) {
-    int bucket_num = storage.bucket(key);
-    LockHolder lh(storage.getMutex(bucket_num));
-    StoredValue *v = storage.unlocked_find(key, bucket_num);
+    StripeLockHolder lh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
 
-    if (v) {
+    if (v && v->isExpired(ep_current_time())) {
+        lh.unlock();
+        expire(key, hash);
+        GetValue rv(false);
+        cb.callback(rv);
+    } else if ((v && !v->isResident())
+               || (!v && unlocked_loadsOnMiss(key))) {
+        lh.unlock();
+        bgFetch(key, hash, BGFetchWaiter(NULL, &cb));
+    } else if (v) {
+        v->markReferenced();
         // return an invalid cas value if the item is locked
         GetValue rv(new Item(v->getKey(), v->getFlags(), v->getExptime(),
-                             v->getValue(), v->isLocked(ep_current_time()) ? -1 : v->getCas()));
+                             v->getValue(), v->isLockedNow(ep_current_time()) ? -1 : v->getCas()));
         cb.callback(rv);
     } else {
         GetValue rv(false);
@@ -138,14 +459,296 @@ void EventuallyPersistentStore::get(const std::string &key,
     lh.unlock();
 }
 
+ENGINE_ERROR_CODE EventuallyPersistentStore::get(const std::string &key,
+                                                 const void *cookie,
+                                                 Item **itm) {
+    uint64_t hash = hashKey(key);
+    StripeLockHolder lh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
+
+    if (!v && unlocked_loadsOnMiss(key)) {
+        lh.unlock();
+        bgFetch(key, hash, BGFetchWaiter(cookie, NULL));
+        return ENGINE_EWOULDBLOCK;
+    } else if (!v) {
+        return ENGINE_KEY_ENOENT;
+    } else if (v->isExpired(ep_current_time())) {
+        lh.unlock();
+        expire(key, hash);
+        return ENGINE_KEY_ENOENT;
+    } else if (!v->isResident()) {
+        lh.unlock();
+        bgFetch(key, hash, BGFetchWaiter(cookie, NULL));
+        return ENGINE_EWOULDBLOCK;
+    }
+
+    v->markReferenced();
+    // return an invalid cas value if the item is locked
+    *itm = new Item(v->getKey(), v->getFlags(), v->getExptime(),
+                    v->getValue(), v->isLockedNow(ep_current_time()) ? -1 : v->getCas());
+    return ENGINE_SUCCESS;
+}
+
+ENGINE_ERROR_CODE EventuallyPersistentStore::exists(const std::string &key,
+                                                    const void *cookie) {
+    uint64_t hash = hashKey(key);
+    StripeLockHolder lh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
+
+    if (v && v->isExpired(ep_current_time())) {
+        lh.unlock();
+        expire(key, hash);
+        return ENGINE_KEY_ENOENT;
+    } else if (v) {
+        return ENGINE_SUCCESS;
+    } else if (!unlocked_loadsOnMiss(key)) {
+        return ENGINE_KEY_ENOENT;
+    }
+    lh.unlock();
+
+    LockHolder qlh(bgFetchMutex);
+    std::map<const void*, std::string>::iterator it;
+    it = fetchedMissing.find(cookie);
+    if (it != fetchedMissing.end()) {
+        bool missing = it->second == key;
+        fetchedMissing.erase(it);
+        if (missing) {
+            return ENGINE_KEY_ENOENT;
+        }
+    }
+    qlh.unlock();
+    bgFetch(key, hash, BGFetchWaiter(cookie, NULL, true));
+    return ENGINE_EWOULDBLOCK;
+}
+
+void EventuallyPersistentStore::bgFetch(const std::string &key,
+                                        uint64_t hash,
+                                        const BGFetchWaiter &waiter) {
+    LockHolder lh(bgFetchMutex);
+    std::list<BGFetchWaiter> &waiting = bgFetchQueue[key];
+    waiting.push_back(waiter);
+    if (waiting.size() == 1) {
+        dispatcher->schedule(shared_ptr<BGFetchCallback>(new BGFetchCallback(this, key,
+                                                                             hash)),
+                             0, 0, task_class_read, underlying);
+    } else {
+        stats.bgFetchCoalesced.incr();
+    }
+}
+
+bool EventuallyPersistentStore::completeBGFetch(const std::string &key,
+                                                uint64_t hash, bool retry) {
+    // The flushers commit on their own connections while we read, so
+    // the item could be set, persisted and ejected again before we're
+    // done.  Any set changes its cas, so a value read while it stays
+    // the same is the one on disk now.
+    uint64_t cas = 0;
+    StripeLockHolder rlh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
+    if (v) {
+        cas = v->getCas();
+    }
+    rlh.unlock();
+
+    RememberingCallback<GetValue> fetched;
+    bool readFailed = false;
+    try {
+        underlying->get(key, hash, fetched);
+        fetched.waitForValue();
+    } catch (std::exception &e) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Failed to read %s: %s\n", key.c_str(), e.what());
+        readFailed = true;
+    }
+
+    bool found = false;
+    bool failed = false;
+    StripeLockHolder lh(storage.getStripeLock(hash));
+    v = storage.unlocked_find(key, hash);
+    if (v && !v->isResident() && v->getCas() == cas
+        && fetched.val.isSuccess()) {
+        storage.unlocked_restoreValue(v, fetched.val.getValue()->getValue());
+        stats.bgFetched.incr();
+        found = true;
+    } else if ((v && !v->isResident())
+               || (!v && readFailed && unlocked_loadsOnMiss(key))) {
+        // It's on disk, or may be, but we couldn't read it, or what
+        // we read has since been replaced; that's no reason to tell
+        // anyone it's not there.
+        failed = true;
+    } else if (!v && fetched.val.isSuccess() && unlocked_loadsOnMiss(key)) {
+        // Not loaded yet; warmup will find it here and skip its row.
+        Item *itm = fetched.val.getValue();
+        v = StoredValue::create(key.data(), key.size(), hash,
+                                itm->getValue(), itm->getFlags(),
+                                itm->getExptime());
+        storage.unlocked_addLoaded(v, Item::nextCasRange(1));
+        stats.curr_items.incr();
+        stats.missFetched.incr();
+        found = true;
+    } else {
+        // Set (or deleted) while we were reading it.
+        found = v != NULL;
+    }
+    bool missing = v == NULL && !failed;
+    lh.unlock();
+    delete fetched.val.getValue();
+
+    if (failed && retry) {
+        return false;
+    } else if (failed) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Gave up reading back the value of %s\n",
+                         key.c_str());
+        stats.bgFetchFailed.incr();
+    }
+
+    // Anyone asking for the key from here on finds it resident.
+    std::list<BGFetchWaiter> waiting;
+    LockHolder qlh(bgFetchMutex);
+    waiting.swap(bgFetchQueue[key]);
+    bgFetchQueue.erase(key);
+    std::list<BGFetchWaiter>::iterator it;
+    if (missing) {
+        for (it = waiting.begin(); it != waiting.end(); ++it) {
+            if (it->existence) {
+                fetchedMissing[it->cookie] = key;
+            }
+        }
+    }
+    qlh.unlock();
+
+    for (it = waiting.begin(); it != waiting.end(); ++it) {
+        if (it->cb != NULL) {
+            if (found) {
+                get(key, hash, *it->cb);
+            } else {
+                GetValue rv(false);
+                it->cb->callback(rv);
+            }
+        } else if (failed) {
+            assert(notifyIOComplete);
+            notifyIOComplete(it->cookie, ENGINE_TMPFAIL);
+        } else {
+            // An existence check is retried either way, to find out
+            // from the hash table or fetchedMissing.
+            assert(notifyIOComplete);
+            notifyIOComplete(it->cookie,
+                             found || it->existence ? ENGINE_SUCCESS
+                                                    : ENGINE_KEY_ENOENT);
+        }
+    }
+    return true;
+}
+
+bool EventuallyPersistentStore::waitForPersistence(const std::string &key,
+                                                   uint64_t cas,
+                                                   const void *cookie) {
+    LockHolder lh(persistWaitMutex);
+    persistWaiters[key].push_back(PersistWaiter(cookie, cas));
+    stats.persistWaiting.incr();
+    lh.unlock();
+
+    // The flusher only looks for waiters once it has taken what it
+    // committed off the queue, so if the key is still queued, we'll
+    // be notified.  If it's gone, a delete superseded the write.
+    uint64_t hash = hashKey(key);
+    StripeLockHolder slh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
+    if (v != NULL && v->isQueued()) {
+        slh.unlock();
+        // Don't leave it to wait out the flusher's min_data_age nap.
+        shardFor(hash).flusher->wake();
+        return true;
+    }
+    slh.unlock();
+
+    // Unless the flusher has just claimed it, take the waiter back.
+    lh.lock();
+    std::map<std::string, std::list<PersistWaiter> >::iterator it;
+    it = persistWaiters.find(key);
+    if (it == persistWaiters.end()) {
+        return true;
+    }
+    std::list<PersistWaiter>::iterator wit;
+    for (wit = it->second.begin(); wit != it->second.end(); ++wit) {
+        if (wit->cookie == cookie) {
+            it->second.erase(wit);
+            if (it->second.empty()) {
+                persistWaiters.erase(it);
+            }
+            stats.persistWaiting.decr();
+            return false;
+        }
+    }
+    return true;
+}
+
+bool EventuallyPersistentStore::unlocked_expire(StoredValue *v,
+                                                rel_time_t now) {
+    if (!v->isExpired(now) || v->isLocked(now)) {
+        return false;
+    }
+    unlocked_queueDirty(v);
+    bool deleted = storage.unlocked_del(v->getKey(), v->getHash());
+    assert(deleted);
+    stats.curr_items.decr();
+    stats.expired.incr();
+    return true;
+}
+
+void EventuallyPersistentStore::expire(const std::string &key,
+                                       uint64_t hash) {
+    StripeLockHolder lh(storage.getStripeLock(hash));
+    StoredValue *v = storage.unlocked_find(key, hash);
+    if (v) {
+        unlocked_expire(v, ep_current_time());
+    }
+}
+
 bool EventuallyPersistentStore::getLocked(const std::string &key,
                                           Callback<GetValue> &cb,
                                           rel_time_t currentTime,
                                           uint32_t lockTimeout) {
 
-    int bucket_num = storage.bucket(key);
-    LockHolder lh(storage.getMutex(bucket_num));
-    StoredValue *v = storage.unlocked_find(key, bucket_num);
+    uint64_t hash = hashKey(key);
+    StripeLockHolder lh(storage.getStripeLock(hash));
+    StoredValue *v = storage.unlocked_find(key, hash);
+
+    if (v && unlocked_expire(v, currentTime)) {
+        v = NULL;
+    }
+
+    // The getl extension can't hand EWOULDBLOCK back to the core, so
+    // bring the value back in here and look again.
+    for (int fetches = 0;
+         (v && !v->isResident()) || (!v && unlocked_loadsOnMiss(key));
+         ++fetches) {
+        bool present = v != NULL;
+        lh.unlock();
+        if (fetches == GETL_MAX_FETCHES) {
+            // Ejected again each time; let the client try later.
+            GetValue rv(false);
+            cb.callback(rv);
+            return false;
+        }
+        RememberingCallback<GetValue> fetched;
+        bgFetch(key, hash, BGFetchWaiter(NULL, &fetched));
+        fetched.waitForValue();
+        if (!fetched.val.isSuccess()) {
+            // Missing, unless it was there and just couldn't be read,
+            // which the client should also try again later.
+            cb.callback(fetched.val);
+            return !present;
+        }
+        delete fetched.val.getValue();
+
+        lh.lock();
+        v = storage.unlocked_find(key, hash);
+        if (v && unlocked_expire(v, currentTime)) {
+            v = NULL;
+        }
+    }
 
     if (v) {
         if (v->isLocked(currentTime)) {
@@ -157,6 +760,7 @@ bool EventuallyPersistentStore::getLocked(const std::string &key,
 
         // acquire lock and increment cas value
 
+        v->markReferenced();
         v->lock(currentTime + lockTimeout);
 
         Item *it = new Item(v->getKey(), v->getFlags(), v->getExptime(),
@@ -180,11 +784,11 @@ bool EventuallyPersistentStore::getKeyStats(const std::string &key,
                                             struct key_stats &kstats)
 {
     bool found = false;
-    int bucket_num = storage.bucket(key);
-    LockHolder lh(storage.getMutex(bucket_num));
-    StoredValue *v = storage.unlocked_find(key, bucket_num);
+    uint64_t hash = hashKey(key);
+    StripeLockHolder lh(storage.getStripeLock(hash), true);
+    StoredValue *v = storage.unlocked_find(key, hash);
 
-    found = (v != NULL);
+    found = (v != NULL && !v->isExpired(ep_current_time()));
     if (found) {
         kstats.dirty = v->isDirty();
         kstats.exptime = v->getExptime();
@@ -204,6 +808,179 @@ void EventuallyPersistentStore::setQueueAgeCap(int to) {
     stats.queue_age_cap.set(to);
 }
 
+void EventuallyPersistentStore::setMaxDataSize(size_t to) {
+    stats.maxDataSize.set(to);
+    stats.mem_high_wat.set(to / 100 * DEFAULT_MEM_HIGH_WAT_PERCENT);
+    stats.mem_low_wat.set(to / 100 * DEFAULT_MEM_LOW_WAT_PERCENT);
+}
+
+void EventuallyPersistentStore::setMemHighWat(size_t to) {
+    stats.mem_high_wat.set(to);
+}
+
+void EventuallyPersistentStore::setMemLowWat(size_t to) {
+    stats.mem_low_wat.set(to);
+}
+
+void EventuallyPersistentStore::setQueueWatermarks(size_t high, size_t low) {
+    stats.queue_high_wat.set(high);
+    stats.queue_low_wat.set(low);
+}
+
+void EventuallyPersistentStore::setDirtyWatermarks(size_t high, size_t low) {
+    stats.dirty_high_wat.set(high);
+    stats.dirty_low_wat.set(low);
+}
+
+bool EventuallyPersistentStore::isWriteThrottled() {
+    size_t queued = stats.queue_size.get() + stats.flusher_todo.get();
+    size_t dirty = storage.getDirtySize();
+    size_t queueHigh = stats.queue_high_wat.get();
+    size_t dirtyHigh = stats.dirty_high_wat.get();
+    if (writesThrottled.get()) {
+        if ((queueHigh == 0 || queued <= stats.queue_low_wat.get())
+            && (dirtyHigh == 0 || dirty <= stats.dirty_low_wat.get())) {
+            writesThrottled.set(false);
+        }
+    } else if ((queueHigh > 0 && queued > queueHigh)
+               || (dirtyHigh > 0 && dirty > dirtyHigh)) {
+        // Racing writers may each count the start of a period; it's
+        // only a stat.
+        writesThrottled.set(true);
+        stats.throttlePeriods.incr();
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Throttling writes: %lu items, %lu bytes queued\n",
+                         static_cast<unsigned long>(queued),
+                         static_cast<unsigned long>(dirty));
+    }
+    if (writesThrottled.get()) {
+        stats.throttledWrites.incr();
+        return true;
+    }
+    return false;
+}
+
+void EventuallyPersistentStore::setCheckpointInterval(size_t to) {
+    stats.checkpoint_interval.set(to);
+}
+
+size_t EventuallyPersistentStore::getLogSize() {
+    size_t rv(0);
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        rv += (*it)->store->getLogSize();
+    }
+    return rv;
+}
+
+void EventuallyPersistentStore::warmup(PersistenceShard &shard) {
+    gettimeofday(&shard.warmupStart, NULL);
+    if (warmupMode != WARMUP_NONE) {
+        LoadStorageKVPairCallback cb(storage, stats, shard.warmedUp,
+                                     &deletedKeys);
+        if (warmupFromAccessLog) {
+            warmupAccessed(shard, cb);
+        } else {
+            shard.store->dumpRows(cb, warmupMode == WARMUP_FULL);
+        }
+        cb.flush();
+    }
+    shard.warmupTimeMs.set(usec_since(shard.warmupStart) / 1000);
+    shard.warmupComplete.set(true);
+
+    if (shardsWarmingUp.decr() == 0) {
+        stats.warmupTime.set(time(NULL) - warmupStart);
+        if (warmupMode != WARMUP_NONE && !warmupFromAccessLog) {
+            stats.keysLoaded.set(true);
+        }
+        stats.warmupComplete.set(true);
+        // Start the flushers that finished first and are waiting.
+        std::vector<PersistenceShard*>::iterator it;
+        for (it = shards.begin(); it != shards.end(); ++it) {
+            if (*it != &shard) {
+                (*it)->flusher->wake();
+            }
+            if (shardsLoading.get() > 0) {
+                dispatcher->schedule(shared_ptr<BackgroundLoader>(new BackgroundLoader(this, *it)),
+                                     0, 0, task_class_read, (*it)->store);
+            }
+        }
+    }
+}
+
+void EventuallyPersistentStore::warmupAccessed(PersistenceShard &shard,
+                                               Callback<DumpedRow> &cb) {
+    std::vector<std::pair<std::string, uint64_t> > keys;
+    AccessLogReader log(accessLog);
+    if (log.open()) {
+        std::string key;
+        while (log.next(key)) {
+            uint64_t hash = hashKey(key);
+            if (&shardFor(hash) == &shard) {
+                keys.push_back(std::make_pair(key, hash));
+            }
+        }
+    }
+
+    // Look them up in key order, so the reads walk the shard's index
+    // in order rather than hopping all over it.
+    std::sort(keys.begin(), keys.end());
+    DumpedRowAdapter adapter(cb, true);
+    std::vector<std::pair<std::string, uint64_t> >::iterator it;
+    for (it = keys.begin(); it != keys.end(); ++it) {
+        shard.store->get(it->first, it->second, adapter);
+    }
+}
+
+bool EventuallyPersistentStore::loadSome(PersistenceShard &shard,
+                                         DumpPosition &pos) {
+    // Values are loaded until memory use reaches the low watermark,
+    // past which the item pager would only eject them again; after
+    // that, just the keys.
+    size_t quota = stats.mem_low_wat.get();
+    bool values = warmupMode == WARMUP_FULL
+        && (quota == 0 || storage.getMemSize() < quota);
+    LoadStorageKVPairCallback cb(storage, stats, stats.backgroundLoaded,
+                                 &deletedKeys);
+    shard.store->dumpRowsFrom(pos, BACKGROUND_LOAD_STEP_ROWS, cb, values);
+    cb.flush();
+    if (!pos.done) {
+        return true;
+    }
+
+    if (shardsLoading.decr() == 0) {
+        stats.keysLoaded.set(true);
+        // There's nothing left on disk for a deleted key to come back
+        // from, nor any need to look there for a missing one.
+        deletedKeys.clear();
+        LockHolder lh(bgFetchMutex);
+        fetchedMissing.clear();
+        lh.unlock();
+        getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                         "Background load complete (%d rows)\n",
+                         (int)stats.backgroundLoaded.get());
+    }
+    return false;
+}
+
+WarmupProgress EventuallyPersistentStore::getWarmupProgress(size_t i) const {
+    const PersistenceShard *shard = shards[i];
+    size_t rows = shard->warmedUp.get();
+    bool complete = shard->warmupComplete.get();
+    uint64_t ms = complete ? shard->warmupTimeMs.get()
+        : usec_since(shard->warmupStart) / 1000;
+    return WarmupProgress(rows, complete,
+                          ms > 0 ? static_cast<size_t>(rows * 1000 / ms) : 0);
+}
+
+void EventuallyPersistentStore::setExpiryPagerSleeptime(size_t to) {
+    stats.exp_pager_stime.set(to);
+}
+
+void EventuallyPersistentStore::setAccessLogInterval(size_t to) {
+    stats.access_log_interval.set(to);
+}
+
 void EventuallyPersistentStore::resetStats(void) {
     stats.tooYoung.set(0);
     stats.tooOld.set(0);
@@ -212,186 +989,396 @@ void EventuallyPersistentStore::resetStats(void) {
     stats.flushDuration.set(0);
     stats.flushDurationHighWat.set(0);
     stats.commit_time.set(0);
+    stats.commitTimeMs.set(0);
 }
 
-void EventuallyPersistentStore::del(const std::string &key, Callback<bool> &cb) {
-    bool existed = storage.del(key);
-    if (existed) {
-        queueDirty(key);
+void EventuallyPersistentStore::del(const std::string &key, uint64_t hash,
+                                    Callback<bool> &cb) {
+    StripeLockHolder lh(storage.getStripeLock(hash));
+    StoredValue *v = storage.unlocked_find(key, hash);
+    bool existed = false;
+    if (v && !v->isLocked(ep_current_time())) {
+        if (unlocked_loadsOnMiss(key)) {
+            deletedKeys.add(key);
+        }
+        unlocked_queueDirty(v);
+        existed = storage.unlocked_del(key, hash);
+        assert(existed);
         stats.curr_items.decr();
+    } else if (!v && unlocked_loadsOnMiss(key)) {
+        // It may be on disk without having been loaded, if the caller
+        // didn't check first.  Delete it there too, through a stand-in
+        // value, and don't load it again.
+        deletedKeys.add(key);
+        v = StoredValue::create(key.data(), key.size(), hash, value_t(),
+                                0, 0);
+        storage.unlocked_addLoaded(v, 0);
+        unlocked_queueDirty(v);
+        storage.unlocked_del(key, hash);
     }
+    lh.unlock();
     cb.callback(existed);
 }
 
-std::queue<std::string>* EventuallyPersistentStore::beginFlush() {
-    std::queue<std::string> *rv(NULL);
-    if (towrite.empty() && writing.empty()) {
+void EventuallyPersistentStore::updateQueueSize() {
+    size_t queued(0);
+    std::vector<PersistenceShard*>::iterator it;
+    for (it = shards.begin(); it != shards.end(); ++it) {
+        queued += (*it)->towrite.size() + (*it)->rejected.get();
+    }
+    stats.queue_size.set(queued);
+}
+
+std::queue<StoredValue*>* EventuallyPersistentStore::beginFlush(PersistenceShard &shard) {
+    std::queue<StoredValue*> *rv(NULL);
+    if (shard.towrite.empty() && shard.writing.empty()) {
         stats.dirtyAge = 0;
     } else {
-        assert(underlying);
-        towrite.getAll(writing);
-        stats.flusher_todo.set(writing.size());
-        stats.queue_size.set(towrite.size());
+        assert(shard.store);
+        shard.towrite.getAll(shard.writing);
+        shard.rejected.set(0);
+        stats.flusher_todo.incr(shard.writing.size());
+        updateQueueSize();
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                          "Flushing %d items with %d still in queue\n",
-                         writing.size(), towrite.size());
-        rv = &writing;
+                         shard.writing.size(), shard.towrite.size());
+        rv = &shard.writing;
     }
     return rv;
 }
 
-void EventuallyPersistentStore::completeFlush(std::queue<std::string> *rej,
+void EventuallyPersistentStore::completeFlush(PersistenceShard &shard,
+                                              std::queue<StoredValue*> *rej,
                                               rel_time_t flush_start) {
     // Requeue the rejects.
-    stats.queue_size += rej->size();
     while (!rej->empty()) {
-        writing.push(rej->front());
+        shard.writing.push(rej->front());
         rej->pop();
     }
+    shard.rejected.set(shard.writing.size());
 
-    stats.queue_size.set(towrite.size() + writing.size());
+    updateQueueSize();
     rel_time_t complete_time = ep_current_time();
     stats.flushDuration.set(complete_time - flush_start);
     stats.flushDurationHighWat.set(std::max(stats.flushDuration.get(),
                                             stats.flushDurationHighWat.get()));
 }
 
-int EventuallyPersistentStore::flushSome(std::queue<std::string> *q,
-                                         std::queue<std::string> *rejectQueue) {
-    int tsz = getTxnSize();
-    underlying->begin();
+std::string EventuallyPersistentStore::getTxnSizeHistory() {
+    LockHolder lh(txnSizeHistoryMutex);
+    std::stringstream ss;
+    std::deque<int>::const_iterator it;
+    for (it = txnSizeHistory.begin(); it != txnSizeHistory.end(); ++it) {
+        if (it != txnSizeHistory.begin()) {
+            ss << ",";
+        }
+        ss << *it;
+    }
+    return ss.str();
+}
+
+int EventuallyPersistentStore::nextTxnSize(PersistenceShard &shard) {
+    int rv = getTxnSize();
+    if (stats.txn_commit_target.get() > 0) {
+        rv = std::min(rv, shard.txnSize);
+    }
+
+    stats.txnSize.set(rv);
+    LockHolder lh(txnSizeHistoryMutex);
+    txnSizeHistory.push_front(rv);
+    if (txnSizeHistory.size() > TXN_SIZE_HISTORY) {
+        txnSizeHistory.pop_back();
+    }
+    return rv;
+}
+
+void EventuallyPersistentStore::adaptTxnSize(PersistenceShard &shard,
+                                             int txnSize, int items,
+                                             uint64_t commitUsec,
+                                             size_t commitFailures) {
+    double target = stats.txn_commit_target.get();
+    if (target == 0) {
+        return;
+    }
+
+    double size = txnSize;
+    double commitMs = commitUsec / 1000.0;
+    if (commitFailures > 0) {
+        // Commits are failing; back off harder the more often they did.
+        size /= 1 << std::min(commitFailures, static_cast<size_t>(8));
+    } else if (items > 0 && shard.txnBytes > 0
+               && (items >= txnSize || commitMs > target)) {
+        // A transaction that didn't fill up says little about a
+        // bigger one, unless it already took too long.
+        double msPerByte = commitMs / shard.txnBytes;
+        if (shard.commitMsPerByte == 0) {
+            shard.commitMsPerByte = msPerByte;
+        } else {
+            shard.commitMsPerByte = TXN_COST_SMOOTHING * msPerByte
+                + (1 - TXN_COST_SMOOTHING) * shard.commitMsPerByte;
+        }
+        double bytesPerItem = static_cast<double>(shard.txnBytes) / items;
+        double want = 2 * size;
+        if (shard.commitMsPerByte > 0) {
+            want = target / (shard.commitMsPerByte * bytesPerItem);
+        }
+        // Move by at most a factor of two at a time, so one odd
+        // commit doesn't swing it far.
+        size = std::max(size / 2, std::min(want, 2 * size));
+    }
+
+    size = std::max(size, static_cast<double>(MIN_ADAPTIVE_TXN_SIZE));
+    shard.txnSize = static_cast<int>(std::min(size,
+                                              static_cast<double>(getTxnSize())));
+}
+
+// Orders queued values by key.  Keys never change, so this needs no
+// locks.
+class StoredValueKeyLess {
+public:
+    bool operator()(const StoredValue *a, const StoredValue *b) const {
+        return a->keyLess(*b);
+    }
+};
+
+int EventuallyPersistentStore::flushSome(PersistenceShard &shard,
+                                         std::queue<StoredValue*> *q,
+                                         std::queue<StoredValue*> *rejectQueue) {
+    int tsz = nextTxnSize(shard);
+    std::vector<StoredValue*> batch;
+    batch.reserve(std::min(q->size(), static_cast<size_t>(tsz)));
+    while (batch.size() < static_cast<size_t>(tsz) && !q->empty()) {
+        batch.push_back(q->front());
+        q->pop();
+    }
+    if (sortFlushBatches.get()) {
+        // Walk the shard's primary key index in order rather than
+        // hopping all over it, so the B-tree pages are written mostly
+        // sequentially and each is touched once per transaction.
+        std::stable_sort(batch.begin(), batch.end(), StoredValueKeyLess());
+    }
+
     int oldest = stats.min_data_age;
-    for (int i = 0; i < tsz && !q->empty(); i++) {
-        int n = flushOne(q, rejectQueue);
+    std::vector<FlushEntry> entries;
+    entries.reserve(batch.size());
+    std::vector<StoredValue*>::iterator it;
+    for (it = batch.begin(); it != batch.end(); ++it) {
+        int n = snapshotOne(*it, &entries, rejectQueue);
         if (n != 0 && n < oldest) {
             oldest = n;
         }
     }
+
+    shard.store->begin();
+    writeBatch(shard, entries);
     rel_time_t cstart = ep_current_time();
-    while (!underlying->commit()) {
+    struct timeval commitStart;
+    gettimeofday(&commitStart, NULL);
+    size_t failures = 0;
+    while (!shard.store->commit()) {
         sleep(1);
         stats.commitFailed.incr();
+        ++failures;
     }
+    uint64_t commitUsec = usec_since(commitStart);
     rel_time_t complete_time = ep_current_time();
 
     stats.commit_time.set(complete_time - cstart);
+    stats.commitTimeMs.set(commitUsec / 1000);
+    adaptTxnSize(shard, tsz, static_cast<int>(batch.size()), commitUsec,
+                 failures);
+
+    std::vector<FlushEntry>::iterator eit;
+    for (eit = entries.begin(); eit != entries.end(); ++eit) {
+        completeOne(*eit, rejectQueue);
+    }
+    notifyPersisted(entries);
+    for (eit = entries.begin(); eit != entries.end(); ++eit) {
+        if (eit->deletion && eit->success) {
+            // The background load may have read the row already; it
+            // forgets the deletions once it's done.
+            if (shardsLoading.get() == 0) {
+                deletedKeys.remove(eit->v->getKey());
+            }
+            // Nothing but the flusher refers to a deleted value.
+            StoredValue::destroy(eit->v);
+        }
+    }
 
     return oldest;
 }
 
+int EventuallyPersistentStore::snapshotOne(StoredValue *v,
+                                           std::vector<FlushEntry> *batch,
+                                           std::queue<StoredValue*> *rejectQueue) {
 
-// This class exists to create a closure around a few variables within
-// EventuallyPersistentStore::flushOne so that an object can be
-// requeued in case of failure to store in the underlying layer.
+    // Queued values aren't destroyed until the flusher is done with
+    // them, so v is valid even if it was deleted meanwhile.
+    stats.flusher_todo.decr();
 
-class Requeuer : public Callback<bool> {
-public:
+    StripeLockHolder lh(storage.getStripeLock(v->getHash()));
 
-    Requeuer(const std::string k, std::queue<std::string> *q,
-             StoredValue *v, rel_time_t qd, rel_time_t d, struct EPStats *s) :
-        key(k), rq(q), sval(v), queued(qd), dirtied(d), stats(s) {
-        assert(rq);
-        assert(s);
+    if (v->isDeleted()) {
+        // Don't remove a key that has been stored again since; its new
+        // value is queued (or already persisted) on its own.
+        if (storage.unlocked_find(v->getKey(), v->getHash()) != NULL) {
+            lh.unlock();
+            deletedKeys.remove(v->getKey());
+            StoredValue::destroy(v);
+        } else {
+            batch->push_back(FlushEntry(v));
+        }
+        return 0;
     }
 
-    void callback(bool &value) {
-        if (!value) {
-            stats->flushFailed.incr();
-            if (sval != NULL) {
-                sval->reDirty(queued, dirtied);
-            }
-            rq->push(key);
-        }
+    if (!v->isDirty()) {
+        storage.unlocked_setQueued(v, false);
+        return 0;
     }
-private:
-    const std::string key;
-    std::queue<std::string> *rq;
-    StoredValue *sval;
-    rel_time_t queued;
-    rel_time_t dirtied;
-    struct EPStats *stats;
-    DISALLOW_COPY_AND_ASSIGN(Requeuer);
-};
 
-int EventuallyPersistentStore::flushOne(std::queue<std::string> *q,
-                                        std::queue<std::string> *rejectQueue) {
+    rel_time_t queued(0), dirtied(0);
+    v->markClean(&queued, &dirtied);
+    assert(dirtied > 0);
+    // Calculate stats if this had a positive time.
+    rel_time_t now = ep_current_time();
+    int dataAge = now - dirtied;
+    int dirtyAge = now - queued;
+
+    if (dirtyAge > stats.queue_age_cap.get()) {
+        stats.tooOld.incr();
+    } else if (dataAge < stats.min_data_age.get()
+               && !hasPersistWaiter(v->getKey())) {
+        // Skip this one.  It's too young.
+        stats.tooYoung.incr();
+        v->reDirty(queued, dirtied);
+        rejectQueue->push(v);
+        return stats.min_data_age.get() - dataAge;
+    }
 
-    std::string key = q->front();
-    q->pop();
+    assert(dirtyAge < (86400 * 30));
+    assert(dataAge <= dirtyAge);
+    stats.dirtyAge.set(dirtyAge);
+    stats.dataAge.set(dataAge);
+    stats.dirtyAgeHighWat.set(std::max(stats.dirtyAge.get(),
+                                       stats.dirtyAgeHighWat.get()));
+    stats.dataAgeHighWat.set(std::max(stats.dataAge.get(),
+                                      stats.dataAgeHighWat.get()));
+
+    // Consider this persisted as it is our intention, though
+    // it may fail and be requeued later.
+    stats.totalPersisted.incr();
+    batch->push_back(FlushEntry(v, queued, dirtied));
+    return 0;
+}
 
-    int bucket_num = storage.bucket(key);
-    LockHolder lh(storage.getMutex(bucket_num));
-    StoredValue *v = storage.unlocked_find(key, bucket_num);
+void EventuallyPersistentStore::writeBatch(PersistenceShard &shard,
+                                           std::vector<FlushEntry> &entries) {
+    // Keys are passed in place; queued values outlive the write.
+    std::vector<Mutation> batch;
+    batch.reserve(entries.size());
+    shard.txnBytes = 0;
+    std::vector<FlushEntry>::iterator it;
+    for (it = entries.begin(); it != entries.end(); ++it) {
+        StoredValue *v = it->v;
+        if (it->deletion) {
+            batch.push_back(Mutation(v->getKeyBytes(), v->getKeyLen(),
+                                     v->getHash()));
+        } else {
+            batch.push_back(Mutation(v->getKeyBytes(), v->getKeyLen(),
+                                     v->getHash(), it->value, it->flags,
+                                     it->exptime, it->cas));
+            shard.txnBytes += it->value->length();
+        }
+        shard.txnBytes += v->getKeyLen();
+    }
 
-    bool found = v != NULL;
-    bool isDirty = (found && v->isDirty());
-    Item *val = NULL;
-    rel_time_t queued(0), dirtied(0);
+    RememberingCallback<std::vector<bool> > cb;
+    shard.store->mutate(batch, cb);
+    cb.waitForValue();
+    assert(cb.val.size() == entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+        entries[i].success = cb.val[i];
+    }
+}
+
+void EventuallyPersistentStore::completeOne(FlushEntry &entry,
+                                            std::queue<StoredValue*> *rejectQueue) {
+    StoredValue *v = entry.v;
+    if (!entry.success) {
+        stats.flushFailed.incr();
+    }
 
-    int ret = 0;
-
-    if (isDirty) {
-        v->markClean(&queued, &dirtied);
-        assert(dirtied > 0);
-        // Calculate stats if this had a positive time.
-        rel_time_t now = ep_current_time();
-        int dataAge = now - dirtied;
-        int dirtyAge = now - queued;
-        bool eligible = true;
-
-        if (dirtyAge > stats.queue_age_cap.get()) {
-            stats.tooOld.incr();
-        } else if (dataAge < stats.min_data_age.get()) {
-            eligible = false;
-            // Skip this one.  It's too young.
-            ret = stats.min_data_age.get() - dataAge;
-            isDirty = false;
-            stats.tooYoung.incr();
-            v->reDirty(queued, dirtied);
-            rejectQueue->push(key);
-        }
-
-        if (eligible) {
-            assert(dirtyAge < (86400 * 30));
-            assert(dataAge <= dirtyAge);
-            stats.dirtyAge.set(dirtyAge);
-            stats.dataAge.set(dataAge);
-            stats.dirtyAgeHighWat.set(std::max(stats.dirtyAge.get(),
-                                               stats.dirtyAgeHighWat.get()));
-            stats.dataAgeHighWat.set(std::max(stats.dataAge.get(),
-                                              stats.dataAgeHighWat.get()));
-            // Copy it for the duration.
-            val = new Item(key, v->getFlags(), v->getExptime(), v->getValue(),
-                           v->getCas());
-
-            // Consider this persisted as it is our intention, though
-            // it may fail and be requeued later.
-            stats.totalPersisted.incr();
+    if (entry.deletion) {
+        // flushSome() destroys the value once it's written.
+        if (!entry.success) {
+            rejectQueue->push(v);
         }
+        return;
     }
-    stats.flusher_todo.decr();
-    lh.unlock();
 
-    if (found && isDirty) {
-        Requeuer cb(key, rejectQueue, v, queued, dirtied, &stats);
-        underlying->set(*val, cb);
-    } else if (!found) {
-        Requeuer cb(key, rejectQueue, v, queued, dirtied, &stats);
-        underlying->del(key, cb);
+    // Values stay queued until their write is committed, so they
+    // can't be ejected and read back from another connection before
+    // it's there to be read.
+    StripeLockHolder lh(storage.getStripeLock(v->getHash()));
+    if (!entry.success) {
+        if (v->isClean()) {
+            v->reDirty(entry.queued, entry.dirtied);
+        }
+        rejectQueue->push(v);
+    } else if (v->isDirty() || v->isDeleted()) {
+        // Changed while we were writing it; it's still queued.
+        rejectQueue->push(v);
+    } else {
+        storage.unlocked_setQueued(v, false);
     }
+}
 
-    if (val != NULL) {
-        delete val;
+void EventuallyPersistentStore::notifyPersisted(std::vector<FlushEntry> &entries) {
+    std::vector<const void*> ready;
+    LockHolder lh(persistWaitMutex);
+    if (persistWaiters.empty()) {
+        return;
     }
+    std::vector<FlushEntry>::iterator eit;
+    for (eit = entries.begin(); eit != entries.end(); ++eit) {
+        if (!eit->success) {
+            continue;
+        }
+        std::map<std::string, std::list<PersistWaiter> >::iterator it;
+        it = persistWaiters.find(eit->v->getKey());
+        if (it == persistWaiters.end()) {
+            continue;
+        }
+        // CAS values only grow, so this covers every earlier write.
+        std::list<PersistWaiter>::iterator wit = it->second.begin();
+        while (wit != it->second.end()) {
+            if (wit->cas <= eit->cas) {
+                ready.push_back(wit->cookie);
+                wit = it->second.erase(wit);
+            } else {
+                ++wit;
+            }
+        }
+        if (it->second.empty()) {
+            persistWaiters.erase(it);
+        }
+    }
+    stats.persistWaiting.decr(ready.size());
+    lh.unlock();
 
-    return ret;
+    stats.persistNotified.incr(ready.size());
+    std::vector<const void*>::iterator cit;
+    for (cit = ready.begin(); cit != ready.end(); ++cit) {
+        assert(notifyIOComplete);
+        notifyIOComplete(*cit, ENGINE_SUCCESS);
+    }
 }
 
-void EventuallyPersistentStore::queueDirty(const std::string &key) {
-    if (doPersistence) {
-        // Assume locked.
-        towrite.push(key);
+void EventuallyPersistentStore::unlocked_queueDirty(StoredValue *v) {
+    if (doPersistence && !v->isQueued()) {
+        storage.unlocked_setQueued(v, true);
+        shardFor(v->getHash()).towrite.push(v);
         stats.totalEnqueued++;
-        stats.queue_size = towrite.size();
+        updateQueueSize();
     }
 }
@@ -14,7 +14,11 @@
 #include <unistd.h>
 
 #include <set>
+#include <map>
+#include <list>
 #include <queue>
+#include <deque>
+#include <vector>
 
 #include <memcached/engine.h>
 
@@ -32,53 +36,523 @@ extern EXTENSION_LOGGER_DESCRIPTOR *getLogger(void);
 #define DEFAULT_TXN_SIZE 50000
 #define MAX_TXN_SIZE 10000000
 
+// Commit time adaptive transaction sizing aims for, in milliseconds.
+// 0 turns it off, and every transaction is up to max_txn_size.
+#define DEFAULT_TXN_COMMIT_TARGET 0
+#define MAX_TXN_COMMIT_TARGET 60000
+// Smallest transaction adaptive sizing will choose.
+#define MIN_ADAPTIVE_TXN_SIZE 10
+// Weight of the newest commit in the smoothed commit cost.
+#define TXN_COST_SMOOTHING 0.3
+// Number of recent transaction sizes kept for stats.
+#define TXN_SIZE_HISTORY 16
+
 #define DEFAULT_MIN_DATA_AGE 120
 #define DEFAULT_MIN_DATA_AGE_CAP 900
 
 #define MAX_DATA_AGE_PARAM 86400
 
+// Seconds between checks of whether the hash table needs resizing.
+#define HT_RESIZE_INTERVAL 5
+// Buckets migrated per step of a running resize, and the pause
+// between steps so other dispatcher tasks get to run.
+#define HT_RESIZE_STEP_SIZE 4096
+#define HT_RESIZE_STEP_INTERVAL 0.01
+
+// Seconds between checks of memory use against the high watermark.
+#define ITEM_PAGER_INTERVAL 5
+// Default watermarks, as percentages of the memory quota.
+#define DEFAULT_MEM_HIGH_WAT_PERCENT 75
+#define DEFAULT_MEM_LOW_WAT_PERCENT 60
+
+// Default low watermarks for write throttling, as percentages of the
+// high ones.
+#define DEFAULT_THROTTLE_LOW_WAT_PERCENT 75
+
+// Most dispatcher worker threads the engine may be configured with.
+#define MAX_DISPATCHER_THREADS 64
+
+// Seconds between checkpoints of each shard's write-ahead log.
+#define DEFAULT_CHECKPOINT_INTERVAL 10
+#define MAX_CHECKPOINT_INTERVAL 3600
+
+// Seconds between passes of the expiry pager over the hash table.
+#define DEFAULT_EXP_PAGER_STIME 3600
+// Lock stripes the expiry pager cleans per step, and the pause
+// between steps so other dispatcher tasks get to run.
+#define EXP_PAGER_STRIPES_PER_STEP 4
+#define EXP_PAGER_STEP_INTERVAL 0.01
+
+// Rows warmup reads before adding them to the hash table, a stripe at
+// a time.
+#define WARMUP_BATCH_SIZE 8192
+
+// Seconds between writes of the access log.
+#define DEFAULT_ACCESS_LOG_INTERVAL 3600
+// Rows the background load reads per step, and the pause between
+// steps so the shard's flusher gets to run.
+#define BACKGROUND_LOAD_STEP_ROWS 10000
+#define BACKGROUND_LOAD_STEP_INTERVAL 0.01
+
+// Times a background fetch tries to read a key that's there (or may
+// be) before giving up, and the pause between tries.  A read may fail
+// on a database locked by a shard's flusher for longer than sqlite's
+// busy timeout.
+#define BG_FETCH_MAX_READS 3
+#define BG_FETCH_RETRY_INTERVAL 1
+
+// Times getl reads a value back in before giving up on locking it,
+// should the pager keep ejecting it again first.
+#define GETL_MAX_FETCHES 3
+
 extern "C" {
     extern rel_time_t (*ep_current_time)();
 }
 
 // Forward declaration
 class Flusher;
+class EventuallyPersistentStore;
+class PersistenceShard;
+
+/**
+ * What warmup loads before the store is complete.
+ */
+typedef enum {
+    /** Every key and its value. */
+    WARMUP_FULL,
+    /** Every key and its metadata; values are read in when asked for. */
+    WARMUP_KEYS,
+    /** Nothing; each key is read in the first time it's asked for. */
+    WARMUP_NONE
+} warmup_mode_t;
+
+/**
+ * Keys deleted while they may be on disk but not in memory: while
+ * warmup or the background load is running, or for good with
+ * WARMUP_NONE.  Neither warmup nor a lookup on a miss may bring them
+ * back until their deletion has been persisted (or, while the
+ * background load runs, until it's done).
+ */
+class DeletedKeys : public HashTableLoadFilter {
+public:
+    DeletedKeys() {
+        count.set(0);
+    }
+
+    void add(const std::string &key) {
+        LockHolder lh(mutex);
+        if (keys[key]++ == 0) {
+            count.incr();
+        }
+    }
+
+    // One deletion of the key has been persisted (or dropped).
+    void remove(const std::string &key) {
+        if (count.get() == 0) {
+            return;
+        }
+        LockHolder lh(mutex);
+        std::map<std::string, int>::iterator it = keys.find(key);
+        if (it != keys.end() && --it->second == 0) {
+            keys.erase(it);
+            count.decr();
+        }
+    }
+
+    bool contains(const std::string &key) {
+        if (count.get() == 0) {
+            return false;
+        }
+        LockHolder lh(mutex);
+        return keys.find(key) != keys.end();
+    }
+
+    bool shouldAdd(const StoredValue *v) {
+        return !contains(v->getKey());
+    }
+
+    // Forget every deletion, once nothing is left to be loaded.
+    void clear() {
+        LockHolder lh(mutex);
+        keys.clear();
+        count.set(0);
+    }
+
+    size_t size() const {
+        return count.get();
+    }
+
+private:
+    Mutex                      mutex;
+    // Deletions of each key not yet persisted.
+    std::map<std::string, int> keys;
+    Atomic<size_t>             count;
+};
 
 /**
  * Helper class used to insert items into the storage by using
  * the KVStore::dump method to load items from the database
  */
-class LoadStorageKVPairCallback : public Callback<GetValue> {
+class LoadStorageKVPairCallback : public Callback<DumpedRow> {
 public:
-    LoadStorageKVPairCallback(HashTable &ht, EPStats &st)
-        : hashtable(ht), stats(st) { }
-
-    void callback(GetValue &val) {
-        Item *i = val.getValue();
-        if (i != NULL) {
-            hashtable.add(*i, true);
-            delete i;
+    LoadStorageKVPairCallback(HashTable &ht, EPStats &st,
+                              Atomic<size_t> &shardRows,
+                              HashTableLoadFilter *f = NULL)
+        : hashtable(ht), stats(st), rows(shardRows), filter(f) {
+        batch.reserve(WARMUP_BATCH_SIZE);
+    }
+
+    void callback(DumpedRow &row) {
+        batch.push_back(StoredValue::create(row.key, row.nkey,
+                                            hashKey(row.key, row.nkey),
+                                            row.value, row.flags,
+                                            row.exptime));
+        if (batch.size() >= WARMUP_BATCH_SIZE) {
+            flush();
         }
-        stats.warmedUp.incr();
+    }
+
+    // Add the rows still batched up; call once the dump is done.
+    void flush() {
+        size_t n = batch.size();
+        stats.curr_items.incr(hashtable.addBatch(batch, filter));
+        stats.warmedUp.incr(n);
+        rows.incr(n);
     }
 
 private:
     HashTable       &hashtable;
     EPStats &stats;
+    Atomic<size_t> &rows;
+    HashTableLoadFilter *filter;
+    std::vector<StoredValue*> batch;
+};
+
+/**
+ * Dispatcher task that grows or shrinks the in-memory hash table as
+ * the number of items changes, migrating a bounded number of buckets
+ * per run.
+ */
+class HashTableResizer : public DispatcherCallback {
+public:
+    HashTableResizer(EventuallyPersistentStore *s) : store(s) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+};
+
+/**
+ * Dispatcher task that ejects the values of clean items once memory
+ * use goes above the high watermark, until it is back below the low
+ * watermark.  Keys and metadata stay resident.
+ */
+class ItemPager : public DispatcherCallback {
+public:
+    ItemPager(EventuallyPersistentStore *s) : store(s) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+};
+
+/**
+ * Dispatcher task that periodically removes expired items from the
+ * hash table and queues their deletion for persistence.  Each run
+ * cleans a few lock stripes, so a pass over a large table is spread
+ * out.
+ */
+class ExpiredItemPager : public DispatcherCallback {
+public:
+    ExpiredItemPager(EventuallyPersistentStore *s) : store(s), stripe(0) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+    // Next lock stripe to clean.
+    size_t                     stripe;
+};
+
+/**
+ * Dispatcher task that checkpoints a shard's write-ahead log every
+ * checkpoint_interval seconds.  It shares the shard's connection with
+ * the flusher, and so never runs in the middle of one of its
+ * transactions.
+ */
+class Checkpointer : public DispatcherCallback {
+public:
+    Checkpointer(EventuallyPersistentStore *s, PersistenceShard *sh) :
+        store(s), shard(sh) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+    PersistenceShard          *shard;
+};
+
+/**
+ * Dispatcher task that writes the keys of the resident items used
+ * since its last run to the access log every access_log_interval
+ * seconds, so that warmup can load the working set first.
+ */
+class AccessScanner : public DispatcherCallback {
+public:
+    AccessScanner(EventuallyPersistentStore *s) : store(s), runs(0) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+    // Times it has run since warmup completed.
+    size_t                     runs;
+};
+
+/**
+ * Dispatcher task that loads the rows of a shard that warmup left on
+ * disk after loading the keys in the access log.  It shares the
+ * shard's connection with the flusher, so it reads a few rows per
+ * step to keep the flusher running.
+ */
+class BackgroundLoader : public DispatcherCallback {
+public:
+    BackgroundLoader(EventuallyPersistentStore *s, PersistenceShard *sh) :
+        store(s), shard(sh) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+    PersistenceShard          *shard;
+    DumpPosition               position;
+};
+
+/**
+ * Dispatcher task that reads an ejected value back in from the
+ * underlying store and hands it to everyone waiting for it.
+ *
+ * The dispatcher never runs it alongside another task on the
+ * underlying store's connection, such as an unsharded store's
+ * flusher, but a sharded store's flushers write on connections of
+ * their own as it reads.  So the value is only restored if the item
+ * wasn't set while it was read.  A read that fails, or that a set has
+ * made stale, is tried again a little later.
+ */
+class BGFetchCallback : public DispatcherCallback {
+public:
+    BGFetchCallback(EventuallyPersistentStore *s, const std::string &k,
+                    uint64_t h) :
+        store(s), key(k), hash(h), reads(0) { }
+    bool callback(Dispatcher &d, TaskId t);
+private:
+    EventuallyPersistentStore *store;
+    std::string                key;
+    uint64_t                   hash;
+    int                        reads;
+};
+
+/**
+ * Someone waiting for a background fetch: either a memcached
+ * connection to notify once the value is in memory (or once it's
+ * known whether the key exists at all), or a callback to complete
+ * with the value.
+ */
+class BGFetchWaiter {
+public:
+    BGFetchWaiter(const void *c, Callback<GetValue> *b, bool e=false) :
+        cookie(c), cb(b), existence(e) { }
+
+    const void         *cookie;
+    Callback<GetValue> *cb;
+    // Whether the connection only wants to know if the key exists.
+    bool                existence;
+};
+
+/**
+ * A memcached connection waiting for its write of a key, with the
+ * given CAS, to be committed.
+ */
+class PersistWaiter {
+public:
+    PersistWaiter(const void *c, uint64_t cs) : cookie(c), cas(cs) { }
+
+    const void *cookie;
+    uint64_t    cas;
+};
+
+/**
+ * The values waiting to be persisted to one shard of the underlying
+ * store, and the flusher that writes them there on a connection of
+ * its own.  The dispatcher never runs two tasks on the same
+ * connection at once.
+ */
+class PersistenceShard {
+public:
+    PersistenceShard(KVStore *s) : store(s), flusher(NULL),
+                                   txnSize(DEFAULT_TXN_SIZE), txnBytes(0),
+                                   commitMsPerByte(0) {
+        rejected.set(0);
+        warmedUp.set(0);
+        warmupComplete.set(false);
+        warmupTimeMs.set(0);
+        gettimeofday(&warmupStart, NULL);
+    }
+
+    KVStore                   *store;
+    Flusher                   *flusher;
+    // Values waiting to be persisted, each queued at most once.
+    AtomicQueue<StoredValue*>  towrite;
+    // Values being persisted by the running flush.
+    std::queue<StoredValue*>   writing;
+    // Values the last flush put back in writing for the next one.
+    Atomic<size_t>             rejected;
+    // Adaptive transaction sizing, touched by the flusher only: the
+    // size of its next transaction, the bytes the running one has
+    // written and the smoothed cost of committing a byte.
+    int                        txnSize;
+    size_t                     txnBytes;
+    double                     commitMsPerByte;
+    // Warmup of this shard's database: rows loaded so far, when it
+    // started and how long it took (ms) once it's complete.
+    Atomic<size_t>             warmedUp;
+    Atomic<bool>               warmupComplete;
+    struct timeval             warmupStart;
+    Atomic<size_t>             warmupTimeMs;
+
+private:
+    DISALLOW_COPY_AND_ASSIGN(PersistenceShard);
+};
+
+/**
+ * How far a shard's warmup has got.
+ */
+class WarmupProgress {
+public:
+    WarmupProgress(size_t r, bool c, size_t rps) :
+        rows(r), complete(c), rowsPerSec(rps) { }
+
+    size_t rows;
+    bool   complete;
+    size_t rowsPerSec;
+};
+
+/**
+ * One value a flusher is writing: what it looked like when the flusher
+ * marked it clean, so it can be written without the stripe lock.  The
+ * key is read from the StoredValue, where it never changes.
+ */
+class FlushEntry {
+public:
+    // A write of v's current value.  Caller holds v's stripe lock.
+    FlushEntry(StoredValue *sv, rel_time_t dirtyAge, rel_time_t dataAge) :
+        v(sv), value(sv->getValue()), cas(sv->getCas()),
+        flags(sv->getFlags()), exptime(sv->getExptime()), queued(dirtyAge),
+        dirtied(dataAge), deletion(false), success(false) { }
+
+    // A delete of v's key.
+    FlushEntry(StoredValue *sv) :
+        v(sv), cas(sv->getCas()), flags(0), exptime(0), queued(0), dirtied(0),
+        deletion(true), success(false) { }
+
+    StoredValue *v;
+    value_t      value;
+    uint64_t     cas;
+    uint32_t     flags;
+    rel_time_t   exptime;
+    // When v was queued and last changed, to dirty it again if the
+    // write fails.
+    rel_time_t   queued;
+    rel_time_t   dirtied;
+    bool         deletion;
+    bool         success;
 };
 
 class EventuallyPersistentStore : public KVStore {
 public:
 
-    EventuallyPersistentStore(KVStore *t, size_t est=32768);
+    /**
+     * Build a store over t.  If shardStores is given, it holds a
+     * connection to each of t's shards, in shard order, and a flusher
+     * per shard persists the keys kept there in parallel.  Otherwise a
+     * single flusher persists everything through t.
+     *
+     * If accessLog names a file, the access scanner keeps the keys in
+     * use there, and warmup loads the keys it lists instead of every
+     * row.  With loadRest, the other rows are then loaded in the
+     * background.
+     *
+     * The flushers and every other task run on a dispatcher of
+     * dispatcherThreads workers, or if that's 0, one per shard plus
+     * one each for reads and non-IO tasks.
+     */
+    EventuallyPersistentStore(KVStore *t,
+                              hash_table_layout_t htLayout=HT_CHAINED,
+                              hash_table_lock_t htLockType=HT_LOCK_MUTEX,
+                              size_t htLocks=DEFAULT_HT_LOCKS,
+                              const std::vector<KVStore*> &shardStores=std::vector<KVStore*>(),
+                              warmup_mode_t warmupMode=WARMUP_FULL,
+                              const std::string &accessLog=std::string(),
+                              bool loadRest=true,
+                              size_t dispatcherThreads=0,
+                              size_t est=32768);
 
     ~EventuallyPersistentStore();
 
     void set(const Item &item, Callback<bool> &cb);
 
-    void get(const std::string &key, Callback<GetValue> &cb);
+    void get(const std::string &key, Callback<GetValue> &cb) {
+        get(key, hashKey(key), cb);
+    }
+
+    void get(const std::string &key, uint64_t hash, Callback<GetValue> &cb);
+
+    /**
+     * Get an item for a memcached connection without blocking on
+     * disk.  If the item's value was ejected, this starts a background
+     * fetch, returns ENGINE_EWOULDBLOCK and notifies the connection
+     * once the value is back in memory.
+     */
+    ENGINE_ERROR_CODE get(const std::string &key, const void *cookie,
+                          Item **itm);
+
+    /**
+     * Find out whether a key exists for a memcached connection without
+     * blocking on disk.  Keys stay in memory when their values are
+     * ejected, so this only has to read one that may not have been
+     * loaded yet: it then returns ENGINE_EWOULDBLOCK and notifies the
+     * connection once the read is done, and the retried call finds the
+     * answer here.
+     *
+     * @return ENGINE_SUCCESS if the key exists, or ENGINE_KEY_ENOENT
+     */
+    ENGINE_ERROR_CODE exists(const std::string &key, const void *cookie);
+
+    /**
+     * Forget what's kept for a memcached connection that has gone
+     * away.
+     */
+    void handleDisconnect(const void *cookie) {
+        LockHolder lh(bgFetchMutex);
+        fetchedMissing.erase(cookie);
+    }
+
+    /**
+     * Set the function used to tell the memcached core that a
+     * connection's blocked request can be retried.
+     */
+    void setNotifyIOComplete(void (*cb)(const void *cookie,
+                                        ENGINE_ERROR_CODE status)) {
+        notifyIOComplete = cb;
+    }
+
+    /**
+     * Have the connection notified once the write of the key with the
+     * given CAS, or a later write or delete of it, has been committed.
+     * The key's flusher is woken up for it, and writes it however
+     * young it is.
+     *
+     * @return false if that has already happened, and the connection
+     *         won't be notified
+     */
+    bool waitForPersistence(const std::string &key, uint64_t cas,
+                            const void *cookie);
+
+    void del(const std::string &key, Callback<bool> &cb) {
+        del(key, hashKey(key), cb);
+    }
 
-    void del(const std::string &key, Callback<bool> &cb);
+    void del(const std::string &key, uint64_t hash, Callback<bool> &cb);
 
     EPStats& getStats() { return stats; }
 
@@ -86,10 +560,54 @@ public:
 
     void setQueueAgeCap(int to);
 
+    /**
+     * Set the memory quota, resetting the watermarks to their default
+     * share of it.  0 disables value ejection.
+     */
+    void setMaxDataSize(size_t to);
+
+    void setMemHighWat(size_t to);
+
+    void setMemLowWat(size_t to);
+
+    // Set the number of seconds between passes of the expiry pager.
+    void setExpiryPagerSleeptime(size_t to);
+
+    /**
+     * Set the watermarks for throttling writes: once the items queued
+     * for persistence or the bytes they hold go over their high
+     * watermark, writes are refused until both are back under their
+     * low one.  A high watermark of 0 turns that check off.
+     */
+    void setQueueWatermarks(size_t high, size_t low);
+    void setDirtyWatermarks(size_t high, size_t low);
+
+    // Whether writes should be refused until the flusher catches up.
+    bool isWriteThrottled();
+
+    // Set the number of seconds between checkpoints of the shards'
+    // write-ahead logs.
+    void setCheckpointInterval(size_t to);
+
+    // Bytes in the shards' write-ahead logs.
+    size_t getLogSize();
+
+    // Set the number of seconds between writes of the access log.
+    void setAccessLogInterval(size_t to);
+
+    // Where the access log is kept, or empty if it isn't.
+    const std::string &getAccessLog() const {
+        return accessLog;
+    }
+
     void resetStats(void);
 
     void startDispatcher(void);
 
+    size_t getDispatcherThreads() const {
+        return dispatcher->getNumWorkers();
+    }
+
     void stopFlusher(void);
 
     void startFlusher(void);
@@ -109,8 +627,36 @@ public:
         storage.visitDepth(visitor);
     }
 
-    void warmup() {
-        static_cast<StrategicSqlite3*>(underlying)->dump(loadStorageKVPairCallback);
+    const HashTable &getHashTable() {
+        return storage;
+    }
+
+    /**
+     * Load a shard's database into the hash table.  Each flusher warms
+     * up its own shard, so with a write worker per shard the shards
+     * load in parallel; warmup is complete once the last of them is
+     * done.
+     */
+    void warmup(PersistenceShard &shard);
+
+    size_t getNumShards() const {
+        return shards.size();
+    }
+
+    /**
+     * Warmup progress of shard i: rows loaded, whether it's done, and
+     * the rows per second it has loaded (or did load) them at.
+     */
+    WarmupProgress getWarmupProgress(size_t i) const;
+
+    warmup_mode_t getWarmupMode() const {
+        return warmupMode;
+    }
+
+    // Deletes of keys that might still have been loaded, not yet
+    // persisted.
+    size_t getNumDeletedKeys() const {
+        return deletedKeys.size();
     }
 
     int getTxnSize() {
@@ -121,44 +667,210 @@ public:
         txnSize.set(to);
     }
 
+    /**
+     * Size each transaction to commit in about this many milliseconds,
+     * up to max_txn_size.  0 makes every transaction max_txn_size.
+     */
+    void setTxnCommitTarget(size_t to) {
+        stats.txn_commit_target.set(to);
+    }
+
+    // Sizes of the most recent transactions, newest first.
+    std::string getTxnSizeHistory();
+
+    /**
+     * Whether each transaction writes its items in key order (the
+     * default) rather than the order they were queued in.
+     */
+    void setSortFlushBatches(bool to) {
+        sortFlushBatches.set(to);
+    }
+
     void setTapStats(size_t depth, size_t fetched) {
         stats.tap_queue.set(depth);
         stats.tap_fetched.set(fetched);
     }
 
+    // The flusher that warms up the store, for its state.
     const Flusher* getFlusher();
 
     bool getKeyStats(const std::string &key, key_stats &kstats);
 
+    /**
+     * Get an item and lock it, waiting for its value to be read back
+     * in if it was ejected.
+     *
+     * @return false if it's locked already, or its value was ejected
+     *         again each time it was read in
+     */
     bool getLocked(const std::string &key, Callback<GetValue> &cb, rel_time_t currentTime, uint32_t lockTimeout);
 
 private:
-    /* Queue an item to be written to persistent layer. */
-    void queueDirty(const std::string &key);
+    // Wait for the value of an ejected item, fetching it if nobody is yet.
+    void bgFetch(const std::string &key, uint64_t hash,
+                 const BGFetchWaiter &waiter);
+
+    /**
+     * Read an ejected value (or a key that hasn't been loaded) back in
+     * and hand it to its waiters.  If the read fails, or the key is
+     * set while it's read, while the key is there or may be, the
+     * waiters are told to try again later, or with retry set they're
+     * left waiting.
+     *
+     * @return false if the read failed and is to be retried
+     */
+    bool completeBGFetch(const std::string &key, uint64_t hash, bool retry);
+
+    /**
+     * Whether a key missing from memory may still be on disk: until
+     * every key has been loaded, or always with WARMUP_NONE, unless
+     * it's been deleted since.  Caller must hold the key's stripe
+     * lock.
+     */
+    bool unlocked_loadsOnMiss(const std::string &key) {
+        return (warmupMode == WARMUP_NONE || !stats.keysLoaded.get())
+            && !deletedKeys.contains(key);
+    }
+
+    // Load the keys in the access log that belong to the shard.
+    void warmupAccessed(PersistenceShard &shard, Callback<DumpedRow> &cb);
+
+    /**
+     * Load the next few rows of the shard in the background.
+     *
+     * @return false once the shard is done
+     */
+    bool loadSome(PersistenceShard &shard, DumpPosition &pos);
+
+    /**
+     * Remove an item if it has expired, and queue its deletion for
+     * persistence.  Caller must hold the item's stripe lock
+     * exclusively.
+     *
+     * @return true if the item was removed
+     */
+    bool unlocked_expire(StoredValue *v, rel_time_t now);
+
+    // Remove the item with the given key if it has expired.
+    void expire(const std::string &key, uint64_t hash);
+
+    /**
+     * Queue a value to be written to (or, once deleted, removed from)
+     * the persistent layer, unless it's queued already.  Caller must
+     * hold the value's stripe lock exclusively.
+     */
+    void unlocked_queueDirty(StoredValue *v);
+
+    // Whether a connection is waiting for the key's write to commit.
+    bool hasPersistWaiter(const std::string &key) {
+        if (stats.persistWaiting.get() == 0) {
+            return false;
+        }
+        LockHolder lh(persistWaitMutex);
+        return persistWaiters.find(key) != persistWaiters.end();
+    }
 
-    std::queue<std::string> *beginFlush();
-    void completeFlush(std::queue<std::string> *rejects,
+    // The shard a value with the given hash is persisted to.
+    PersistenceShard &shardFor(uint64_t hash) {
+        return *shards[hash % shards.size()];
+    }
+
+    // Publish the number of values waiting in all shards' queues.
+    void updateQueueSize();
+
+    std::queue<StoredValue*> *beginFlush(PersistenceShard &shard);
+    void completeFlush(PersistenceShard &shard,
+                       std::queue<StoredValue*> *rejects,
                        rel_time_t flush_start);
 
-    int flushSome(std::queue<std::string> *q,
-                  std::queue<std::string> *rejectQueue);
-    int flushOne(std::queue<std::string> *q,
-                  std::queue<std::string> *rejectQueue);
+    // The number of items the shard's next transaction may write.
+    int nextTxnSize(PersistenceShard &shard);
+
+    /**
+     * Choose the size of the shard's next transaction from how its
+     * last one, of the given size, went.
+     */
+    void adaptTxnSize(PersistenceShard &shard, int txnSize, int items,
+                      uint64_t commitUsec, size_t commitFailures);
+
+    int flushSome(PersistenceShard &shard, std::queue<StoredValue*> *q,
+                  std::queue<StoredValue*> *rejectQueue);
+    /**
+     * Mark a queued value clean and add what's to be written for it to
+     * the batch, taking its stripe lock just for that.  Values that
+     * are too young to write, and that no connection is waiting on, go
+     * to rejectQueue.
+     *
+     * @return how much too young the value was, or 0
+     */
+    int snapshotOne(StoredValue *v, std::vector<FlushEntry> *batch,
+                    std::queue<StoredValue*> *rejectQueue);
+
+    /**
+     * Write the snapshots to the shard as one batch, without any
+     * stripe locks held, recording whether each write succeeded.
+     */
+    void writeBatch(PersistenceShard &shard, std::vector<FlushEntry> &entries);
+
+    /**
+     * Once its transaction committed, take a written value off the
+     * queue, or requeue it if the write failed or it changed since.
+     */
+    void completeOne(FlushEntry &entry,
+                     std::queue<StoredValue*> *rejectQueue);
+
+    /**
+     * Notify, all at once, the connections waiting for writes the
+     * batch just committed.
+     */
+    void notifyPersisted(std::vector<FlushEntry> &entries);
 
     friend class Flusher;
+    friend class HashTableResizer;
+    friend class ItemPager;
+    friend class ExpiredItemPager;
+    friend class BGFetchCallback;
+    friend class Checkpointer;
+    friend class AccessScanner;
+    friend class BackgroundLoader;
     bool                       doPersistence;
     KVStore                   *underlying;
     size_t                     est_size;
     Dispatcher                *dispatcher;
-    Flusher                   *flusher;
+    // One per shard, each warming up its own database.
+    std::vector<PersistenceShard*> shards;
+    // Shards still warming up, and when warmup started.
+    Atomic<size_t>             shardsWarmingUp;
+    time_t                     warmupStart;
+    warmup_mode_t              warmupMode;
+    DeletedKeys                deletedKeys;
+    std::string                accessLog;
+    // Whether warmup loads the keys in the access log, and whether the
+    // rest are loaded afterwards.
+    bool                       warmupFromAccessLog;
+    bool                       loadRest;
+    // Shards whose background load isn't done.
+    Atomic<size_t>             shardsLoading;
     HashTable                  storage;
     SyncObject                 mutex;
-    AtomicQueue<std::string>   towrite;
-    std::queue<std::string>    writing;
     pthread_t                  thread;
     EPStats                    stats;
-    LoadStorageKVPairCallback  loadStorageKVPairCallback;
     Atomic<int>                txnSize;
+    Atomic<bool>               sortFlushBatches;
+    Atomic<bool>               writesThrottled;
+    Mutex                      txnSizeHistoryMutex;
+    std::deque<int>            txnSizeHistory;
+    // Keys being fetched in the background, and who's waiting for them.
+    std::map<std::string, std::list<BGFetchWaiter> > bgFetchQueue;
+    // The key each connection's existence check had a background
+    // fetch find nowhere, until the check is retried or the
+    // connection goes away.
+    std::map<const void*, std::string> fetchedMissing;
+    Mutex                      bgFetchMutex;
+    // Connections waiting for their writes to be committed, by key.
+    std::map<std::string, std::list<PersistWaiter> > persistWaiters;
+    Mutex                      persistWaitMutex;
+    void (*notifyIOComplete)(const void *cookie, ENGINE_ERROR_CODE status);
     DISALLOW_COPY_AND_ASSIGN(EventuallyPersistentStore);
 };
 
@@ -89,7 +89,7 @@ extern "C" {
                                       uint64_t *cas,
                                       ENGINE_STORE_OPERATION operation)
     {
-        return getHandle(handle)->store(cookie, item, cas, operation);
+        return getHandle(handle)->clientStore(cookie, item, cas, operation);
     }
 
     static ENGINE_ERROR_CODE EvpArithmetic(ENGINE_HANDLE* handle,
@@ -182,6 +182,12 @@ extern "C" {
             } else if (strcmp(keyz, "max_txn_size") == 0) {
                 validate(v, 1, MAX_TXN_SIZE);
                 e->setTxnSize(v);
+            } else if (strcmp(keyz, "txn_commit_target_ms") == 0) {
+                validate(v, 0, MAX_TXN_COMMIT_TARGET);
+                e->setTxnCommitTarget(v);
+            } else if (strcmp(keyz, "checkpoint_interval") == 0) {
+                validate(v, 1, MAX_CHECKPOINT_INTERVAL);
+                e->setCheckpointInterval(v);
             } else {
                 *msg = "Unknown config param";
                 rv = PROTOCOL_BINARY_RESPONSE_KEY_ENOENT;
@@ -367,8 +373,19 @@ EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
     return NULL;
 }
 
+char EventuallyPersistentEngine::persistedMarker;
+
 EventuallyPersistentEngine::EventuallyPersistentEngine(GET_SERVER_API get_server_api) :
-    dbname("/tmp/test.db"), initFile(NULL), warmup(true), wait_for_warmup(true),
+    dbname("/tmp/test.db"), initFile(NULL), journalMode(NULL),
+    checkpointInterval(DEFAULT_CHECKPOINT_INTERVAL),
+    warmup(true), wait_for_warmup(true), warmupMode(WARMUP_FULL),
+    accessLogInterval(DEFAULT_ACCESS_LOG_INTERVAL), warmupLoadRest(true),
+    htLayout(HT_CHAINED), htLockType(HT_LOCK_MUTEX),
+    htLocks(DEFAULT_HT_LOCKS), dispatcherThreads(0), maxSize(0),
+    memHighWat(0), memLowWat(0),
+    expiryPagerSleeptime(DEFAULT_EXP_PAGER_STIME),
+    txnCommitTarget(DEFAULT_TXN_COMMIT_TARGET), queueHighWat(0),
+    queueLowWat(0), dirtyHighWat(0), dirtyLowWat(0), persistNotify(false),
     sqliteDb(NULL), epstore(NULL), databaseInitTime(0), shutdown(false),
     getServerApi(get_server_api)
 {
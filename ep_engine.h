@@ -225,8 +225,9 @@ public:
         ENGINE_ERROR_CODE ret = ENGINE_SUCCESS;
 
         if (config != NULL) {
-            char *dbn = NULL, *initf = NULL;
-            const int max_items = 7;
+            char *dbn = NULL, *initf = NULL, *htl = NULL, *htlt = NULL;
+            char *jmode = NULL, *wmode = NULL, *alog = NULL;
+            const int max_items = 27;
             struct config_item items[max_items];
             int ii = 0;
             memset(items, 0, sizeof(items));
@@ -240,6 +241,16 @@ public:
             items[ii].datatype = DT_STRING;
             items[ii].value.dt_string = &initf;
 
+            ++ii;
+            items[ii].key = "journal_mode";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &jmode;
+
+            ++ii;
+            items[ii].key = "checkpoint_interval";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &checkpointInterval;
+
             ++ii;
             items[ii].key = "warmup";
             items[ii].datatype = DT_BOOL;
@@ -250,11 +261,101 @@ public:
             items[ii].datatype = DT_BOOL;
             items[ii].value.dt_bool = &wait_for_warmup;
 
+            ++ii;
+            items[ii].key = "warmup_mode";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &wmode;
+
+            ++ii;
+            items[ii].key = "warmup_load_rest";
+            items[ii].datatype = DT_BOOL;
+            items[ii].value.dt_bool = &warmupLoadRest;
+
+            ++ii;
+            items[ii].key = "access_log";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &alog;
+
+            ++ii;
+            items[ii].key = "access_log_interval";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &accessLogInterval;
+
             ++ii;
             items[ii].key = "tap_keepalive";
             items[ii].datatype = DT_SIZE;
             items[ii].value.dt_size = &tapKeepAlive;
 
+            ++ii;
+            items[ii].key = "ht_layout";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &htl;
+
+            ++ii;
+            items[ii].key = "ht_lock_type";
+            items[ii].datatype = DT_STRING;
+            items[ii].value.dt_string = &htlt;
+
+            ++ii;
+            items[ii].key = "ht_locks";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &htLocks;
+
+            ++ii;
+            items[ii].key = "dispatcher_threads";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &dispatcherThreads;
+
+            ++ii;
+            items[ii].key = "max_size";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &maxSize;
+
+            ++ii;
+            items[ii].key = "mem_high_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &memHighWat;
+
+            ++ii;
+            items[ii].key = "mem_low_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &memLowWat;
+
+            ++ii;
+            items[ii].key = "exp_pager_stime";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &expiryPagerSleeptime;
+
+            ++ii;
+            items[ii].key = "txn_commit_target_ms";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &txnCommitTarget;
+
+            ++ii;
+            items[ii].key = "queue_high_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &queueHighWat;
+
+            ++ii;
+            items[ii].key = "queue_low_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &queueLowWat;
+
+            ++ii;
+            items[ii].key = "dirty_high_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &dirtyHighWat;
+
+            ++ii;
+            items[ii].key = "dirty_low_wat";
+            items[ii].datatype = DT_SIZE;
+            items[ii].value.dt_size = &dirtyLowWat;
+
+            ++ii;
+            items[ii].key = "persist_notify";
+            items[ii].datatype = DT_BOOL;
+            items[ii].value.dt_bool = &persistNotify;
+
             ++ii;
             items[ii].key = "config_file";
             items[ii].datatype = DT_CONFIGFILE;
@@ -271,6 +372,109 @@ public:
                 if (initf != NULL) {
                     initFile = initf;
                 }
+                if (jmode != NULL) {
+                    static const char * const modes[] = {
+                        "delete", "truncate", "persist", "memory", "wal",
+                        "off", NULL
+                    };
+                    for (int i = 0; modes[i] != NULL; ++i) {
+                        if (strcasecmp(jmode, modes[i]) == 0) {
+                            journalMode = modes[i];
+                        }
+                    }
+                    if (journalMode == NULL) {
+                        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Unknown journal_mode: %s\n", jmode);
+                        ret = ENGINE_FAILED;
+                    }
+                    free(jmode);
+                }
+                if (checkpointInterval == 0
+                    || checkpointInterval > MAX_CHECKPOINT_INTERVAL) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "checkpoint_interval must be 1 to %d\n",
+                                     MAX_CHECKPOINT_INTERVAL);
+                    ret = ENGINE_FAILED;
+                }
+                if (wmode != NULL) {
+                    if (strcmp(wmode, "full") == 0) {
+                        warmupMode = WARMUP_FULL;
+                    } else if (strcmp(wmode, "keys") == 0) {
+                        warmupMode = WARMUP_KEYS;
+                    } else if (strcmp(wmode, "none") == 0) {
+                        warmupMode = WARMUP_NONE;
+                    } else {
+                        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Unknown warmup_mode: %s\n", wmode);
+                        ret = ENGINE_FAILED;
+                    }
+                    free(wmode);
+                }
+                if (alog != NULL) {
+                    accessLog = alog;
+                    free(alog);
+                }
+                if (htl != NULL) {
+                    if (strcmp(htl, "chained") == 0) {
+                        htLayout = HT_CHAINED;
+                    } else if (strcmp(htl, "tagged") == 0) {
+                        htLayout = HT_TAGGED;
+                    } else {
+                        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Unknown ht_layout: %s\n", htl);
+                        ret = ENGINE_FAILED;
+                    }
+                    free(htl);
+                }
+                if (htlt != NULL) {
+                    if (strcmp(htlt, "mutex") == 0) {
+                        htLockType = HT_LOCK_MUTEX;
+                    } else if (strcmp(htlt, "rwlock") == 0) {
+                        htLockType = HT_LOCK_RWLOCK;
+                    } else {
+                        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Unknown ht_lock_type: %s\n", htlt);
+                        ret = ENGINE_FAILED;
+                    }
+                    free(htlt);
+                }
+                if (htLocks == 0) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "ht_locks must be at least 1\n");
+                    ret = ENGINE_FAILED;
+                }
+                if (dispatcherThreads > MAX_DISPATCHER_THREADS) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "dispatcher_threads must be at most %d\n",
+                                     MAX_DISPATCHER_THREADS);
+                    ret = ENGINE_FAILED;
+                }
+                if (maxSize > 0) {
+                    if (memHighWat == 0) {
+                        memHighWat = maxSize / 100 * DEFAULT_MEM_HIGH_WAT_PERCENT;
+                    }
+                    if (memLowWat == 0) {
+                        memLowWat = maxSize / 100 * DEFAULT_MEM_LOW_WAT_PERCENT;
+                    }
+                    if (memLowWat > memHighWat || memHighWat > maxSize) {
+                        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                         "Need mem_low_wat <= mem_high_wat <= max_size\n");
+                        ret = ENGINE_FAILED;
+                    }
+                }
+                if (queueLowWat == 0) {
+                    queueLowWat = queueHighWat
+                        * DEFAULT_THROTTLE_LOW_WAT_PERCENT / 100;
+                }
+                if (dirtyLowWat == 0) {
+                    dirtyLowWat = dirtyHighWat
+                        * DEFAULT_THROTTLE_LOW_WAT_PERCENT / 100;
+                }
+                if (queueLowWat > queueHighWat || dirtyLowWat > dirtyHighWat) {
+                    getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                                     "Need queue_low_wat <= queue_high_wat and dirty_low_wat <= dirty_high_wat\n");
+                    ret = ENGINE_FAILED;
+                }
             }
         }
 
@@ -280,8 +484,17 @@ public:
                 MultiDBSqliteStrategy *strategy =
                     new MultiDBSqliteStrategy(dbname,
                                               initFile,
-                                              NUMBER_OF_SHARDS);
+                                              NUMBER_OF_SHARDS,
+                                              journalMode);
                 sqliteDb = new StrategicSqlite3(strategy);
+                // A connection per shard for its flusher to write on.
+                for (int i = 0; i < strategy->getNumShards(); ++i) {
+                    SqliteStrategy *ss =
+                        new SqliteStrategy(strategy->shardFile(i).c_str(),
+                                           initFile, journalMode);
+                    shardStrategies.push_back(ss);
+                    shardDbs.push_back(new StrategicSqlite3(ss));
+                }
             } catch (std::exception& e) {
                 std::stringstream ss;
                 ss << "Failed to create database: " << e.what() << std::endl;
@@ -296,11 +509,35 @@ public:
             }
 
             databaseInitTime = time(NULL) - start;
-            backend = epstore = new EventuallyPersistentStore(sqliteDb);
+            backend = epstore = new EventuallyPersistentStore(sqliteDb,
+                                                              htLayout,
+                                                              htLockType,
+                                                              htLocks,
+                                                              shardDbs,
+                                                              warmupMode,
+                                                              accessLogInterval > 0
+                                                              ? accessLog
+                                                              : std::string(),
+                                                              warmupLoadRest,
+                                                              dispatcherThreads);
 
             if (backend == NULL) {
                 ret = ENGINE_ENOMEM;
             } else {
+                epstore->setNotifyIOComplete(serverApi->core->notify_io_complete);
+                if (maxSize > 0) {
+                    epstore->setMaxDataSize(maxSize);
+                    epstore->setMemHighWat(memHighWat);
+                    epstore->setMemLowWat(memLowWat);
+                }
+                epstore->setExpiryPagerSleeptime(expiryPagerSleeptime);
+                epstore->setTxnCommitTarget(txnCommitTarget);
+                epstore->setQueueWatermarks(queueHighWat, queueLowWat);
+                epstore->setDirtyWatermarks(dirtyHighWat, dirtyLowWat);
+                epstore->setCheckpointInterval(checkpointInterval);
+                if (accessLogInterval > 0) {
+                    epstore->setAccessLogInterval(accessLogInterval);
+                }
                 if (!warmup) {
                     backend->reset();
                 }
@@ -361,6 +598,12 @@ public:
     {
         (void)cas;
         std::string k(static_cast<const char*>(key), nkey);
+        // A key that may only be on disk is read first, so the client
+        // learns whether there was anything to delete.
+        ENGINE_ERROR_CODE ret = epstore->exists(k, cookie);
+        if (ret == ENGINE_EWOULDBLOCK || ret == ENGINE_TMPFAIL) {
+            return ret;
+        }
         return itemDelete(cookie, k);
     }
 
@@ -369,7 +612,7 @@ public:
         (void)cookie;
         RememberingCallback<bool> delCb;
 
-        backend->del(key, delCb);;
+        backend->del(key, hashKey(key), delCb);
         delCb.waitForValue();
         if (delCb.val) {
             addDeleteEvent(key);
@@ -393,18 +636,37 @@ public:
                           const void* key,
                           const int nkey)
     {
-        (void)cookie;
+        std::string k(static_cast<const char*>(key), nkey);
+        Item *it = NULL;
+        ENGINE_ERROR_CODE rv = epstore->get(k, cookie, &it);
+        if (rv == ENGINE_SUCCESS) {
+            *item = it;
+        }
+        return rv;
+    }
+
+    /**
+     * Get an item, waiting for its value to be read in from disk if
+     * it was ejected.  For callers that can't hand ENGINE_EWOULDBLOCK
+     * back to the core.
+     */
+    ENGINE_ERROR_CODE getBlocking(item** item,
+                                  const void* key,
+                                  const int nkey)
+    {
         std::string k(static_cast<const char*>(key), nkey);
         RememberingCallback<GetValue> getCb;
-        backend->get(k, getCb);
+        backend->get(k, hashKey(k), getCb);
         getCb.waitForValue();
         if (getCb.val.isSuccess()) {
             *item = getCb.val.getValue();
             return ENGINE_SUCCESS;
-        } else {
-            return ENGINE_KEY_ENOENT;
         }
-
+        // A key that's still in memory is only missing its value,
+        // which couldn't be read back in just now.
+        key_stats kstats;
+        return epstore->getKeyStats(k, kstats) ? ENGINE_TMPFAIL
+                                               : ENGINE_KEY_ENOENT;
     }
 
     ENGINE_ERROR_CODE getStats(const void* cookie,
@@ -419,12 +681,55 @@ public:
             rv = doTapStats(cookie, add_stat);
         } else if (nkey == 4 && strncmp(stat_key, "hash", 3) == 0) {
             rv = doHashStats(cookie, add_stat);
+        } else if (nkey == 5 && strncmp(stat_key, "locks", 5) == 0) {
+            rv = doLockStats(cookie, add_stat);
         } else if (nkey > 4 && strncmp(stat_key, "key ", 4) == 0) {
             rv = doKeyStats(cookie, add_stat, &stat_key[4], nkey-4);
         }
         return rv;
     }
 
+    /**
+     * Store an item for a memcached client.  While the flusher is too
+     * far behind, this fails temporarily.  With persist_notify set,
+     * a successful store returns ENGINE_EWOULDBLOCK instead, and the
+     * client is notified once the write has been committed; the
+     * retried call then completes it.
+     */
+    ENGINE_ERROR_CODE clientStore(const void *cookie,
+                                  item* itm,
+                                  uint64_t *cas,
+                                  ENGINE_STORE_OPERATION operation)
+    {
+        Item *it = static_cast<Item*>(itm);
+        // A retry of a store that's now persisted; it's already done, so
+        // it's never throttled.
+        if (serverApi->core->get_engine_specific(cookie) == &persistedMarker) {
+            serverApi->core->store_engine_specific(cookie, NULL);
+            *cas = it->getCas();
+            return ENGINE_SUCCESS;
+        }
+
+        if (epstore->isWriteThrottled()) {
+            return ENGINE_TMPFAIL;
+        }
+        if (!persistNotify) {
+            return store(cookie, itm, cas, operation);
+        }
+
+        ENGINE_ERROR_CODE ret = store(cookie, itm, cas, operation);
+        if (ret == ENGINE_SUCCESS) {
+            // Mark the connection first; it may be notified at once.
+            serverApi->core->store_engine_specific(cookie, &persistedMarker);
+            if (epstore->waitForPersistence(it->getKey(), *cas, cookie)) {
+                ret = ENGINE_EWOULDBLOCK;
+            } else {
+                serverApi->core->store_engine_specific(cookie, NULL);
+            }
+        }
+        return ret;
+    }
+
     ENGINE_ERROR_CODE store(const void *cookie,
                             item* itm,
                             uint64_t *cas,
@@ -457,10 +762,10 @@ public:
 
             case OPERATION_ADD:
                 // @todo this isn't atomic!
-                if (get(cookie, &i, it->getKey().c_str(), it->getNKey()) == ENGINE_SUCCESS) {
-                    itemRelease(cookie, i);
+                ret = epstore->exists(it->getKey(), cookie);
+                if (ret == ENGINE_SUCCESS) {
                     ret = ENGINE_NOT_STORED;
-                } else {
+                } else if (ret == ENGINE_KEY_ENOENT) {
                     backend->set(*it, callback);
                     // unable to set if the key is locked
                     if ((mutation_type_t)callback.getStatus() == IS_LOCKED) {
@@ -474,8 +779,8 @@ public:
 
             case OPERATION_REPLACE:
                 // @todo this isn't atomic!
-                if (get(cookie, &i, it->getKey().c_str(), it->getNKey()) == ENGINE_SUCCESS) {
-                    itemRelease(cookie, i);
+                ret = epstore->exists(it->getKey(), cookie);
+                if (ret == ENGINE_SUCCESS) {
                     backend->set(*it, callback);
                     // unable to set if the key is locked
                     if ((mutation_type_t)callback.getStatus() == IS_LOCKED) {
@@ -484,7 +789,7 @@ public:
                     *cas = it->getCas();
                     addMutationEvent(it);
                     ret = ENGINE_SUCCESS;
-                } else {
+                } else if (ret == ENGINE_KEY_ENOENT) {
                     ret = ENGINE_NOT_STORED;
                 }
                 break;
@@ -636,7 +941,7 @@ public:
             lh.unlock();
 
             ENGINE_ERROR_CODE r;
-            r = get(cookie, itm, key.c_str(), (int)key.length());
+            r = getBlocking(itm, key.c_str(), (int)key.length());
             if (r == ENGINE_SUCCESS) {
                 ret = TAP_MUTATION;
             } else if (r == ENGINE_KEY_ENOENT) {
@@ -651,6 +956,12 @@ public:
                                      "Failed to allocate memory for deletion of: %s\n", key.c_str());
                     ret = TAP_PAUSE;
                 }
+            } else if (r == ENGINE_TMPFAIL) {
+                // Send it once it can be read; the notifier wakes
+                // paused connections up every second.
+                lh.lock();
+                connection->addEvent(key);
+                connection->paused = true;
             }
         } else if (connection->shouldFlush()) {
             ret = TAP_FLUSH;
@@ -800,6 +1111,7 @@ public:
     void queueBackfill(TapConnection *tc);
 
     void handleDisconnect(const void *cookie) {
+        epstore->handleDisconnect(cookie);
         LockHolder lh(tapNotifySync);
         std::map<const void*, TapConnection*>::iterator iter;
         iter = tapConnectionMap.find(cookie);
@@ -859,9 +1171,25 @@ public:
         epstore->setTxnSize(to);
     }
 
+    void setTxnCommitTarget(size_t to) {
+        epstore->setTxnCommitTarget(to);
+    }
+
+    void setCheckpointInterval(size_t to) {
+        epstore->setCheckpointInterval(to);
+    }
+
     ~EventuallyPersistentEngine() {
         delete epstore;
         delete sqliteDb;
+        std::vector<KVStore*>::iterator it;
+        for (it = shardDbs.begin(); it != shardDbs.end(); ++it) {
+            delete *it;
+        }
+        std::vector<SqliteStrategy*>::iterator sit;
+        for (sit = shardStrategies.begin(); sit != shardStrategies.end(); ++sit) {
+            delete *sit;
+        }
         delete getlExtension;
     }
 
@@ -1104,6 +1432,13 @@ private:
                             epstats.queue_age_cap, add_stat, cookie);
             add_casted_stat("ep_max_txn_size",
                             epstore->getTxnSize(), add_stat, cookie);
+            add_casted_stat("ep_txn_commit_target_ms",
+                            epstats.txn_commit_target, add_stat, cookie);
+            add_casted_stat("ep_txn_size",
+                            epstats.txnSize, add_stat, cookie);
+            add_casted_stat("ep_txn_size_history",
+                            epstore->getTxnSizeHistory().c_str(),
+                            add_stat, cookie);
             add_casted_stat("ep_data_age",
                             epstats.dataAge, add_stat, cookie);
             add_casted_stat("ep_data_age_highwat",
@@ -1129,22 +1464,126 @@ private:
                             add_stat, cookie);
             add_casted_stat("ep_commit_time",
                             epstats.commit_time, add_stat, cookie);
+            add_casted_stat("ep_commit_time_ms",
+                            epstats.commitTimeMs, add_stat, cookie);
             add_casted_stat("ep_flush_duration",
                             epstats.flushDuration, add_stat, cookie);
             add_casted_stat("ep_flush_duration_highwat",
                             epstats.flushDurationHighWat, add_stat, cookie);
             add_casted_stat("curr_items", epstats.curr_items, add_stat,
                             cookie);
+            add_casted_stat("mem_used",
+                            epstore->getHashTable().getMemSize(),
+                            add_stat, cookie);
+            add_casted_stat("ep_kv_size",
+                            epstore->getHashTable().getKVSize(),
+                            add_stat, cookie);
+            add_casted_stat("ep_overhead",
+                            epstore->getHashTable().getOverhead(),
+                            add_stat, cookie);
+            add_casted_stat("ep_max_data_size", epstats.maxDataSize,
+                            add_stat, cookie);
+            add_casted_stat("ep_mem_high_wat", epstats.mem_high_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_mem_low_wat", epstats.mem_low_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_num_value_ejects", epstats.numValueEjects,
+                            add_stat, cookie);
+            add_casted_stat("ep_num_non_resident",
+                            epstore->getHashTable().getNumNonResident(),
+                            add_stat, cookie);
+            add_casted_stat("ep_bg_fetched", epstats.bgFetched,
+                            add_stat, cookie);
+            add_casted_stat("ep_bg_fetch_coalesced", epstats.bgFetchCoalesced,
+                            add_stat, cookie);
+            add_casted_stat("ep_miss_fetched", epstats.missFetched,
+                            add_stat, cookie);
+            add_casted_stat("ep_bg_fetch_failed", epstats.bgFetchFailed,
+                            add_stat, cookie);
+            add_casted_stat("ep_deleted_keys", epstore->getNumDeletedKeys(),
+                            add_stat, cookie);
+            add_casted_stat("ep_wal_size", epstore->getLogSize(),
+                            add_stat, cookie);
+            add_casted_stat("ep_checkpoints", epstats.checkpoints,
+                            add_stat, cookie);
+            add_casted_stat("ep_checkpoint_time_ms", epstats.checkpointTimeMs,
+                            add_stat, cookie);
+            add_casted_stat("ep_checkpoint_interval",
+                            epstats.checkpoint_interval, add_stat, cookie);
+            add_casted_stat("ep_dispatcher_threads",
+                            epstore->getDispatcherThreads(), add_stat, cookie);
+            add_casted_stat("ep_queue_high_wat", epstats.queue_high_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_queue_low_wat", epstats.queue_low_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_dirty_size",
+                            epstore->getHashTable().getDirtySize(),
+                            add_stat, cookie);
+            add_casted_stat("ep_dirty_high_wat", epstats.dirty_high_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_dirty_low_wat", epstats.dirty_low_wat,
+                            add_stat, cookie);
+            add_casted_stat("ep_throttle_periods", epstats.throttlePeriods,
+                            add_stat, cookie);
+            add_casted_stat("ep_throttled_writes", epstats.throttledWrites,
+                            add_stat, cookie);
+            add_casted_stat("ep_persist_notify",
+                            persistNotify ? "true" : "false",
+                            add_stat, cookie);
+            add_casted_stat("ep_persist_waiting", epstats.persistWaiting,
+                            add_stat, cookie);
+            add_casted_stat("ep_persist_notified", epstats.persistNotified,
+                            add_stat, cookie);
+            add_casted_stat("ep_expired", epstats.expired, add_stat, cookie);
+            add_casted_stat("ep_exp_pager_stime", epstats.exp_pager_stime,
+                            add_stat, cookie);
+            add_casted_stat("ep_exp_pager_expired", epstats.expiryPagerExpired,
+                            add_stat, cookie);
+            add_casted_stat("ep_exp_pager_runs", epstats.expiryPagerRuns,
+                            add_stat, cookie);
+            add_casted_stat("ep_exp_pager_stripes_done",
+                            epstats.expiryPagerStripesDone, add_stat, cookie);
 
             if (warmup) {
                 add_casted_stat("ep_warmup_thread",
                                 epstats.warmupComplete.get() ? "complete" : "running",
                                 add_stat, cookie);
                 add_casted_stat("ep_warmed_up", epstats.warmedUp, add_stat, cookie);
+                for (size_t i = 0; i < epstore->getNumShards(); ++i) {
+                    WarmupProgress p = epstore->getWarmupProgress(i);
+                    char stat[80];
+                    snprintf(stat, sizeof(stat), "ep_warmup_shard_%lu:state",
+                             static_cast<unsigned long>(i));
+                    add_casted_stat(stat, p.complete ? "complete" : "running",
+                                    add_stat, cookie);
+                    snprintf(stat, sizeof(stat), "ep_warmup_shard_%lu:rows",
+                             static_cast<unsigned long>(i));
+                    add_casted_stat(stat, p.rows, add_stat, cookie);
+                    snprintf(stat, sizeof(stat),
+                             "ep_warmup_shard_%lu:rows_per_sec",
+                             static_cast<unsigned long>(i));
+                    add_casted_stat(stat, p.rowsPerSec, add_stat, cookie);
+                }
                 if (epstats.warmupComplete.get()) {
                     add_casted_stat("ep_warmup_time", epstats.warmupTime,
                                     add_stat, cookie);
                 }
+                add_casted_stat("ep_warmup_keys_loaded",
+                                epstats.keysLoaded.get() ? "true" : "false",
+                                add_stat, cookie);
+                add_casted_stat("ep_warmup_background_rows",
+                                epstats.backgroundLoaded, add_stat, cookie);
+            }
+
+            if (!epstore->getAccessLog().empty()) {
+                add_casted_stat("ep_access_log", epstore->getAccessLog().c_str(),
+                                add_stat, cookie);
+                add_casted_stat("ep_access_log_interval",
+                                epstats.access_log_interval, add_stat, cookie);
+                add_casted_stat("ep_access_scanner_runs",
+                                epstats.accessScannerRuns, add_stat, cookie);
+                add_casted_stat("ep_access_log_keys", epstats.accessLogKeys,
+                                add_stat, cookie);
             }
 
             add_casted_stat("ep_tap_total_queue", epstats.tap_queue,
@@ -1157,8 +1596,14 @@ private:
 
         add_casted_stat("ep_dbname", dbname, add_stat, cookie);
         add_casted_stat("ep_dbinit", databaseInitTime, add_stat, cookie);
+        add_casted_stat("ep_journal_mode",
+                        journalMode ? journalMode : "default",
+                        add_stat, cookie);
         add_casted_stat("ep_warmup", warmup ? "true" : "false",
                         add_stat, cookie);
+        static const char * const warmupModes[] = { "full", "keys", "none" };
+        add_casted_stat("ep_warmup_mode", warmupModes[warmupMode],
+                        add_stat, cookie);
         return ENGINE_SUCCESS;
     }
 
@@ -1169,6 +1614,60 @@ private:
         }
         add_casted_stat("ep_hash_min_depth", depthVisitor.min, add_stat, cookie);
         add_casted_stat("ep_hash_max_depth", depthVisitor.max, add_stat, cookie);
+        if (epstore) {
+            const HashTable &ht = epstore->getHashTable();
+            add_casted_stat("ep_hash_layout",
+                            ht.getLayout() == HT_TAGGED ? "tagged" : "chained",
+                            add_stat, cookie);
+            add_casted_stat("ep_hash_lock_type",
+                            ht.getLockType() == HT_LOCK_RWLOCK ? "rwlock" : "mutex",
+                            add_stat, cookie);
+            add_casted_stat("ep_hash_size", ht.getSize(), add_stat, cookie);
+            add_casted_stat("ep_hash_num_items", ht.getNumItems(),
+                            add_stat, cookie);
+            add_casted_stat("ep_hash_num_resizes", ht.getNumResizes(),
+                            add_stat, cookie);
+            add_casted_stat("ep_hash_resizing",
+                            ht.isResizing() ? "true" : "false",
+                            add_stat, cookie);
+            if (ht.isResizing()) {
+                add_casted_stat("ep_hash_resize_buckets_done",
+                                ht.getResizeBucketsDone(), add_stat, cookie);
+                add_casted_stat("ep_hash_resize_buckets_total",
+                                ht.getResizeBucketsTotal(), add_stat, cookie);
+            }
+        }
+        return ENGINE_SUCCESS;
+    }
+
+    ENGINE_ERROR_CODE doLockStats(const void *cookie, ADD_STAT add_stat) {
+        if (epstore) {
+            const HashTable &ht = epstore->getHashTable();
+            size_t acquisitions = 0, contended = 0;
+            uint64_t waitTime = 0;
+            for (size_t i = 0; i < ht.getNumLocks(); ++i) {
+                const HashStripeLock &l = ht.getStripe(i);
+                char stat[80];
+                snprintf(stat, sizeof(stat), "stripe_%lu:acquisitions",
+                         static_cast<unsigned long>(i));
+                add_casted_stat(stat, l.getAcquisitions(), add_stat, cookie);
+                snprintf(stat, sizeof(stat), "stripe_%lu:contended",
+                         static_cast<unsigned long>(i));
+                add_casted_stat(stat, l.getContended(), add_stat, cookie);
+                snprintf(stat, sizeof(stat), "stripe_%lu:wait_us",
+                         static_cast<unsigned long>(i));
+                add_casted_stat(stat, l.getWaitTime(), add_stat, cookie);
+                acquisitions += l.getAcquisitions();
+                contended += l.getContended();
+                waitTime += l.getWaitTime();
+            }
+            add_casted_stat("ep_lock_stripes", ht.getNumLocks(),
+                            add_stat, cookie);
+            add_casted_stat("ep_lock_acquisitions", acquisitions,
+                            add_stat, cookie);
+            add_casted_stat("ep_lock_contended", contended, add_stat, cookie);
+            add_casted_stat("ep_lock_wait_us", waitTime, add_stat, cookie);
+        }
         return ENGINE_SUCCESS;
     }
 
@@ -1228,11 +1727,36 @@ private:
 
     const char *dbname;
     const char *initFile;
+    const char *journalMode;
+    size_t checkpointInterval;
     bool warmup;
     bool wait_for_warmup;
+    warmup_mode_t warmupMode;
+    std::string accessLog;
+    size_t accessLogInterval;
+    bool warmupLoadRest;
+    hash_table_layout_t htLayout;
+    hash_table_lock_t htLockType;
+    size_t htLocks;
+    size_t dispatcherThreads;
+    size_t maxSize;
+    size_t memHighWat;
+    size_t memLowWat;
+    size_t expiryPagerSleeptime;
+    size_t txnCommitTarget;
+    size_t queueHighWat;
+    size_t queueLowWat;
+    size_t dirtyHighWat;
+    size_t dirtyLowWat;
+    bool persistNotify;
+    // The engine data of a connection whose store is committed.
+    static char persistedMarker;
     SERVER_HANDLE_V1 *serverApi;
     KVStore *backend;
     StrategicSqlite3 *sqliteDb;
+    // Per-shard connections, one for each flusher.
+    std::vector<KVStore*> shardDbs;
+    std::vector<SqliteStrategy*> shardStrategies;
     EventuallyPersistentStore *epstore;
     std::map<const void*, TapConnection*> tapConnectionMap;
     std::list<TapConnection*> allTaps;
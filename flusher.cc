@@ -65,8 +65,9 @@ bool Flusher::transition_state(enum flusher_state to) {
 
     _state = to;
     //Reschedule the task
+    LockHolder lh(taskMutex);
     dispatcher->cancel(task);
-    start();
+    schedule();
     return true;
 }
 
@@ -82,30 +83,56 @@ void Flusher::initialize(void) {
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                      "Initializing flusher; warming up\n");
 
-    time_t startTime = time(NULL);
-    store->warmup();
-    store->stats.warmupTime.set(time(NULL) - startTime);
-    store->stats.warmupComplete.set(true);
-    store->stats.curr_items.incr(store->stats.warmedUp.get());
+    store->warmup(*shard);
+    warmsUp = false;
 
     getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
-                     "Warmup completed in %ds\n", store->stats.warmupTime.get());
-    transition_state(running);
+                     "Shard warmup completed in %dms (%d rows)\n",
+                     (int)shard->warmupTimeMs.get(),
+                     (int)shard->warmedUp.get());
+    if (store->stats.warmupComplete.get()) {
+        getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
+                         "Warmup completed in %ds\n",
+                         store->stats.warmupTime.get());
+    }
 }
 
 void Flusher::start(void) {
-    task = dispatcher->schedule(shared_ptr<FlusherStepper>(new FlusherStepper(this)));
+    LockHolder lh(taskMutex);
+    schedule();
+}
+
+// Caller must hold taskMutex.
+void Flusher::schedule(void) {
+    // Flushing writes to the shard's connection, so no other task on
+    // it may run at the same time.
+    task = dispatcher->schedule(shared_ptr<FlusherStepper>(new FlusherStepper(this)),
+                                0, 0, task_class_write, shard->store);
 }
 
 void Flusher::wake(void) {
-    dispatcher->wake(task);
+    LockHolder lh(taskMutex);
+    // Once is enough until it gets to run; stores waiting on it wake
+    // it up one after another.
+    if (!woken.get()) {
+        woken.set(true);
+        task = dispatcher->wake(task);
+    }
 }
 
 bool Flusher::step(Dispatcher &d, TaskId tid) {
+    woken.set(false);
     try {
         switch (_state) {
         case initializing:
-            initialize();
+            if (warmsUp) {
+                initialize();
+            }
+            if (store->stats.warmupComplete.get()) {
+                transition_state(running);
+            } else {
+                d.snooze(tid, 1);
+            }
             return true;
         case paused:
             return false;
@@ -157,15 +184,15 @@ bool Flusher::step(Dispatcher &d, TaskId tid) {
 
 int Flusher::doFlush() {
     int rv(store->stats.min_data_age);
-    std::queue<std::string> *q = store->beginFlush();
+    std::queue<StoredValue*> *q = store->beginFlush(*shard);
     if (q) {
         getLogger()->log(EXTENSION_LOG_DEBUG, NULL,
                          "Flushing a write queue.\n");
-        std::queue<std::string> *rejectQueue = new std::queue<std::string>();
+        std::queue<StoredValue*> *rejectQueue = new std::queue<StoredValue*>();
         rel_time_t flush_start = ep_current_time();
 
         while (!q->empty()) {
-            int n = store->flushSome(q, rejectQueue);
+            int n = store->flushSome(*shard, q, rejectQueue);
             if (_state == pausing) {
                 transition_state(paused);
             }
@@ -173,7 +200,7 @@ int Flusher::doFlush() {
                 rv = n;
             }
         }
-        store->completeFlush(rejectQueue, flush_start);
+        store->completeFlush(*shard, rejectQueue, flush_start);
         getLogger()->log(EXTENSION_LOG_INFO, NULL,
                          "Completed a flush, age of oldest item was %ds\n",
                          rv);
@@ -27,8 +27,16 @@ private:
 
 class Flusher {
 public:
-    Flusher(EventuallyPersistentStore *st, Dispatcher *d) :
-        store(st), _state(initializing), dispatcher(d) {
+    /**
+     * A flusher persisting the values queued in the given shard.  It
+     * first warms up that shard, then waits for the others to finish
+     * before it starts flushing.
+     */
+    Flusher(EventuallyPersistentStore *st, Dispatcher *d,
+            PersistenceShard *sh) :
+        store(st), shard(sh), warmsUp(true), _state(initializing),
+        dispatcher(d) {
+        woken.set(false);
     }
     ~Flusher() {
         stop();
@@ -52,10 +60,18 @@ public:
     const char * stateName() const;
 private:
     EventuallyPersistentStore *store;
+    PersistenceShard *shard;
+    bool warmsUp;
     volatile enum flusher_state _state;
+    // The task stepping the flusher, replaced whenever it's woken or
+    // rescheduled.
+    Mutex taskMutex;
     TaskId task;
+    // Whether it's been woken and hasn't stepped since.
+    Atomic<bool> woken;
     Dispatcher *dispatcher;
     const char * stateName(enum flusher_state st) const;
+    void schedule(void);
     int doFlush();
 
     DISALLOW_COPY_AND_ASSIGN(Flusher);
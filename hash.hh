@@ -0,0 +1,74 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef HASH_HH
+#define HASH_HH 1
+
+#include <string>
+#include <string.h>
+#include <inttypes.h>
+
+/**
+ * Hash a key.
+ *
+ * This is MurmurHash64A, which consumes the key eight bytes at a
+ * time.  Words are read as little-endian so the result (and with it
+ * the database shard a key is stored in) is the same on every
+ * platform.
+ *
+ * Every key is hashed once per request and the result is carried
+ * along with the Item and StoredValue, so the hash table bucket, its
+ * lock stripe and the database shard are all derived from the same
+ * value.
+ */
+inline uint64_t hashKey(const char *key, size_t nkey) {
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = 0x5bd1e9955bd1e995ULL ^ (nkey * m);
+
+    const char *p = key;
+    const char *end = key + (nkey & ~static_cast<size_t>(7));
+    while (p != end) {
+        uint64_t k;
+        memcpy(&k, p, sizeof(k));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        k = __builtin_bswap64(k);
+#endif
+        p += sizeof(k);
+
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+
+        h ^= k;
+        h *= m;
+    }
+
+    const unsigned char *tail = reinterpret_cast<const unsigned char*>(p);
+    switch (nkey & 7) {
+    case 7: h ^= static_cast<uint64_t>(tail[6]) << 48;
+        // FALLTHROUGH
+    case 6: h ^= static_cast<uint64_t>(tail[5]) << 40;
+        // FALLTHROUGH
+    case 5: h ^= static_cast<uint64_t>(tail[4]) << 32;
+        // FALLTHROUGH
+    case 4: h ^= static_cast<uint64_t>(tail[3]) << 24;
+        // FALLTHROUGH
+    case 3: h ^= static_cast<uint64_t>(tail[2]) << 16;
+        // FALLTHROUGH
+    case 2: h ^= static_cast<uint64_t>(tail[1]) << 8;
+        // FALLTHROUGH
+    case 1: h ^= static_cast<uint64_t>(tail[0]);
+        h *= m;
+    }
+
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+
+    return h;
+}
+
+inline uint64_t hashKey(const std::string &key) {
+    return hashKey(key.data(), key.length());
+}
+
+#endif /* HASH_HH */
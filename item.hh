@@ -3,6 +3,7 @@
 #define ITEM_HH
 #include "config.h"
 #include "mutex.hh"
+#include "hash.hh"
 #include <string>
 #include <string.h>
 #include <stdio.h>
@@ -19,7 +20,7 @@ class Item {
 public:
     Item(const void* k, const size_t nk, const size_t nb,
          const int fl, const rel_time_t exp, uint64_t theCas = 0) :
-        flags(fl), exptime(exp), cas(theCas)
+        flags(fl), exptime(exp), cas(theCas), hash(0), hashed(false)
     {
         key.assign(static_cast<const char*>(k), nk);
         setData(NULL, nb);
@@ -27,7 +28,7 @@ public:
 
     Item(const std::string &k, const int fl, const rel_time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0) :
-        flags(fl), exptime(exp), cas(theCas)
+        flags(fl), exptime(exp), cas(theCas), hash(0), hashed(false)
     {
         key.assign(k);
         setData(static_cast<const char*>(dta), nb);
@@ -35,14 +36,14 @@ public:
 
     Item(const std::string &k, const int fl, const rel_time_t exp,
          value_t val, uint64_t theCas = 0) :
-        flags(fl), exptime(exp), value(val), cas(theCas)
+        flags(fl), exptime(exp), value(val), cas(theCas), hash(0), hashed(false)
     {
         key.assign(k);
     }
 
     Item(const void *k, uint16_t nk, const int fl, const rel_time_t exp,
          const void *dta, const size_t nb, uint64_t theCas = 0) :
-        flags(fl), exptime(exp), cas(theCas)
+        flags(fl), exptime(exp), cas(theCas), hash(0), hashed(false)
     {
         key.assign(static_cast<const char*>(k), nk);
         setData(static_cast<const char*>(dta), nb);
@@ -62,6 +63,27 @@ public:
         return key;
     }
 
+    /**
+     * Get the hash of this item's key, computing it the first time
+     * it's asked for.
+     */
+    uint64_t getHash() const {
+        if (!hashed) {
+            hash = hashKey(key);
+            hashed = true;
+        }
+        return hash;
+    }
+
+    /**
+     * Seed the hash of this item's key when the caller already has it
+     * (e.g. when copying a StoredValue).
+     */
+    void setHash(uint64_t h) {
+        hash = h;
+        hashed = true;
+    }
+
     int getNKey() const {
         return static_cast<int>(key.length());
     }
@@ -90,6 +112,29 @@ public:
         cas = ncas;
     }
 
+    /**
+     * Take n consecutive CAS values at once, for callers stamping a
+     * batch of values without an Item for each.
+     *
+     * @return the first of them
+     */
+    static uint64_t nextCasRange(size_t n) {
+        uint64_t ret;
+        casMutex.acquire();
+        ret = casCounter;
+        casCounter += n;
+        casMutex.release();
+        // Notify as nextCas() would have for the last multiple of the
+        // frequency in the range.
+        uint64_t last = (ret + n - 1) / casNotificationFrequency
+            * casNotificationFrequency;
+        if (n > 0 && last >= ret) {
+            casNotifier(last);
+        }
+
+        return ret;
+    }
+
     /**
      * Append another item to this item
      *
@@ -154,6 +199,8 @@ private:
     std::string key;
     value_t value;
     uint64_t cas;
+    mutable uint64_t hash;
+    mutable bool hashed;
 
     static uint64_t nextCas(void) {
         uint64_t ret;
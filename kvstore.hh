@@ -8,6 +8,7 @@
 #include <iostream>
 #include <sstream>
 #include <list>
+#include <vector>
 
 #include "common.hh"
 #include "callbacks.hh"
@@ -39,6 +40,89 @@ private:
     bool success;
 };
 
+/**
+ * A set or delete, as one of a batch passed to KVStore::mutate().  The
+ * key isn't copied, so it must outlive the call.
+ */
+class Mutation {
+public:
+    // Set the key to the given value.
+    Mutation(const char *k, size_t nk, uint64_t h, value_t v,
+             uint32_t fl, rel_time_t exp, uint64_t c) :
+        key(k), nkey(nk), hash(h), value(v), flags(fl), exptime(exp),
+        cas(c), deletion(false) { }
+
+    // Delete the key.
+    Mutation(const char *k, size_t nk, uint64_t h) :
+        key(k), nkey(nk), hash(h), flags(0), exptime(0), cas(0),
+        deletion(true) { }
+
+    const char *key;
+    size_t      nkey;
+    uint64_t    hash;
+    value_t     value;
+    uint32_t    flags;
+    rel_time_t  exptime;
+    uint64_t    cas;
+    bool        deletion;
+};
+
+/**
+ * A row as KVStore::dumpRows() reads it.  The key points into the
+ * store's buffers, so it's only valid during the callback.  The value
+ * is NULL if the dump was asked for keys only.
+ */
+class DumpedRow {
+public:
+    DumpedRow(const char *k, size_t nk, value_t v, uint32_t fl,
+              rel_time_t exp) :
+        key(k), nkey(nk), value(v), flags(fl), exptime(exp) { }
+
+    const char *key;
+    size_t      nkey;
+    value_t     value;
+    uint32_t    flags;
+    rel_time_t  exptime;
+};
+
+/**
+ * How far a dump done a piece at a time with KVStore::dumpRowsFrom()
+ * has got.  What table and row mean is up to the store.
+ */
+class DumpPosition {
+public:
+    DumpPosition() : table(0), row(0), done(false) { }
+
+    size_t   table;
+    uint64_t row;
+    bool     done;
+};
+
+/**
+ * Hands the items a dump() or get() reads to a DumpedRow callback.
+ * Misses are skipped.
+ */
+class DumpedRowAdapter : public Callback<GetValue> {
+public:
+    DumpedRowAdapter(Callback<DumpedRow> &c, bool v) : cb(c), values(v) { }
+
+    void callback(GetValue &gv) {
+        if (!gv.isSuccess()) {
+            return;
+        }
+        Item *itm = gv.getValue();
+        DumpedRow row(itm->getKey().data(), itm->getKey().size(),
+                      values ? itm->getValue() : value_t(),
+                      itm->getFlags(), itm->getExptime());
+        cb.callback(row);
+        delete itm;
+    }
+
+private:
+    Callback<DumpedRow> &cb;
+    bool values;
+};
+
 /**
  * An individual kv storage (or way to access a kv storage).
  */
@@ -77,18 +161,69 @@ public:
      * Get the value for the given key.
      *
      * @param key the key
+     * @param hash the key's hash, from hashKey()
      * @param cb callback that will fire with the retrieved value
      */
-    virtual void get(const std::string &key, Callback<GetValue> &cb) = 0;
+    virtual void get(const std::string &key, uint64_t hash,
+                     Callback<GetValue> &cb) = 0;
 
     /**
      * Delete a value for a key.
      *
      * @param key the key
+     * @param hash the key's hash, from hashKey()
      * @param cb callback that will fire with true if the value
      *           existed and then was deleted
      */
-    virtual void del(const std::string &key, Callback<bool> &cb) = 0;
+    virtual void del(const std::string &key, uint64_t hash,
+                     Callback<bool> &cb) = 0;
+
+    /**
+     * Apply a batch of sets and deletes.  A batch holds at most one
+     * mutation per key, and they may be applied in any order.
+     *
+     * This implementation applies them one at a time with set() and
+     * del().
+     *
+     * @param batch the mutations
+     * @param cb callback that will fire once, with whether each
+     *           mutation succeeded in the order of the batch
+     */
+    virtual void mutate(const std::vector<Mutation> &batch,
+                        Callback<std::vector<bool> > &cb) {
+        std::vector<bool> rv;
+        rv.reserve(batch.size());
+        std::vector<Mutation>::const_iterator it;
+        for (it = batch.begin(); it != batch.end(); ++it) {
+            RememberingCallback<bool> done;
+            std::string key(it->key, it->nkey);
+            if (it->deletion) {
+                del(key, it->hash, done);
+            } else {
+                Item itm(key, it->flags, it->exptime, it->value, it->cas);
+                itm.setHash(it->hash);
+                set(itm, done);
+            }
+            done.waitForValue();
+            rv.push_back(done.val);
+        }
+        cb.callback(rv);
+    }
+
+    /**
+     * Checkpoint the write-ahead log the store keeps, if it keeps one,
+     * into its database without blocking readers or writers.
+     *
+     * @return false if the store keeps no such log
+     */
+    virtual bool checkpoint() {
+        return false;
+    }
+
+    // Bytes in the store's write-ahead log.
+    virtual size_t getLogSize() {
+        return 0;
+    }
 
     /**
      * Dump the kvstore
@@ -96,6 +231,39 @@ public:
      */
     virtual void dump(Callback<GetValue> &cb) = 0;
 
+    /**
+     * Dump the kvstore without making an Item of each row.
+     *
+     * This implementation goes through dump().
+     *
+     * @param cb callback that will fire with each row
+     * @param values false to dump only the keys and their metadata
+     */
+    virtual void dumpRows(Callback<DumpedRow> &cb, bool values = true) {
+        DumpedRowAdapter adapter(cb, values);
+        dump(adapter);
+    }
+
+    /**
+     * Dump the next few rows of the kvstore, so that a long dump can
+     * take turns with other work on the same connection.  Rows stored
+     * again after the dump started may be passed again.
+     *
+     * This implementation dumps everything on the first call.
+     *
+     * @param pos where the previous call got to; marked done once
+     *            every row has been passed
+     * @param limit the most rows to pass
+     * @param cb callback that will fire with each row
+     * @param values false to dump only the keys and their metadata
+     */
+    virtual void dumpRowsFrom(DumpPosition &pos, size_t limit,
+                              Callback<DumpedRow> &cb, bool values = true) {
+        (void)limit;
+        dumpRows(cb, values);
+        pos.done = true;
+    }
+
     /**
      * For things that support transactions, this signals the
      * beginning of one.
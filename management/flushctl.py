@@ -23,6 +23,8 @@ def usage():
     print >> sys.stderr, "    min_data_age  - minimum data age before flushing data"
     print >> sys.stderr, "    queue_age_cap - maximum queue age before flushing data"
     print >> sys.stderr, "    max_txn_size - maximum number of items in a flusher transaction"
+    print >> sys.stderr, "    txn_commit_target_ms - commit time to size transactions for (0: off)"
+    print >> sys.stderr, "    checkpoint_interval - seconds between write-ahead log checkpoints"
     exit(1)
 
 if __name__ == '__main__':
@@ -13,10 +13,15 @@
 
 /**
  * Abstraction built on top of pthread mutexes
+ *
+ * Acquisitions first try the lock and only block when it is busy, so
+ * each mutex keeps count of how often it was taken, how often that
+ * had to wait, and for how long.  The counters are only updated with
+ * the lock held; reading them without it gives approximate values.
  */
 class Mutex {
 public:
-    Mutex() {
+    Mutex() : acquisitions(0), contended(0), waitTime(0) {
         if (pthread_mutex_init(&mutex, NULL) != 0) {
             std::string message = "MUTEX ERROR: Failed to initialize mutex: ";
             message.append(std::strerror(errno));
@@ -33,11 +38,22 @@ public:
     }
 
     void acquire() {
-        if (pthread_mutex_lock(&mutex) != 0) {
+        int e = pthread_mutex_trylock(&mutex);
+        if (e == EBUSY) {
+            struct timeval start;
+            gettimeofday(&start, NULL);
+            e = pthread_mutex_lock(&mutex);
+            if (e == 0) {
+                ++contended;
+                waitTime += usec_since(start);
+            }
+        }
+        if (e != 0) {
             std::string message = "MUTEX ERROR: Failed to acquire lock: ";
-            message.append(std::strerror(errno));
+            message.append(std::strerror(e));
             throw std::runtime_error(message);
         }
+        ++acquisitions;
     }
 
     void release() {
@@ -48,8 +64,26 @@ public:
         }
     }
 
+    // Number of times this mutex was acquired.
+    size_t getAcquisitions() const {
+        return acquisitions;
+    }
+
+    // Number of acquisitions that found the mutex held.
+    size_t getContended() const {
+        return contended;
+    }
+
+    // Total microseconds spent waiting in contended acquisitions.
+    uint64_t getWaitTime() const {
+        return waitTime;
+    }
+
 protected:
     pthread_mutex_t mutex;
+    size_t          acquisitions;
+    size_t          contended;
+    uint64_t        waitTime;
 
     DISALLOW_COPY_AND_ASSIGN(Mutex);
 };
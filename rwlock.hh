@@ -0,0 +1,113 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef RWLOCK_HH
+#define RWLOCK_HH 1
+
+#include <stdexcept>
+#include <iostream>
+#include <sstream>
+#include <pthread.h>
+#include <cerrno>
+#include <cstring>
+
+#include "common.hh"
+#include "atomic.hh"
+
+/**
+ * Abstraction built on top of pthread rwlocks
+ *
+ * Like Mutex, this tries the lock before blocking on it and counts
+ * acquisitions, contended acquisitions and the time spent waiting.
+ * Readers update the counters concurrently, so they are atomic.
+ */
+class RWLock {
+public:
+    RWLock() : acquisitions(0), contended(0), waitTime(0) {
+        if (pthread_rwlock_init(&lock, NULL) != 0) {
+            std::string message = "RWLOCK ERROR: Failed to initialize lock: ";
+            message.append(std::strerror(errno));
+            throw std::runtime_error(message);
+        }
+    }
+
+    ~RWLock() {
+        if (pthread_rwlock_destroy(&lock) != 0) {
+            std::string message = "RWLOCK ERROR: Failed to destroy lock: ";
+            message.append(std::strerror(errno));
+            throw std::runtime_error(message);
+        }
+    }
+
+    void readLock() {
+        int e = pthread_rwlock_tryrdlock(&lock);
+        if (e == EBUSY) {
+            struct timeval start;
+            gettimeofday(&start, NULL);
+            e = pthread_rwlock_rdlock(&lock);
+            if (e == 0) {
+                waited(start);
+            }
+        }
+        if (e != 0) {
+            std::string message = "RWLOCK ERROR: Failed to acquire read lock: ";
+            message.append(std::strerror(e));
+            throw std::runtime_error(message);
+        }
+        ++acquisitions;
+    }
+
+    void writeLock() {
+        int e = pthread_rwlock_trywrlock(&lock);
+        if (e == EBUSY) {
+            struct timeval start;
+            gettimeofday(&start, NULL);
+            e = pthread_rwlock_wrlock(&lock);
+            if (e == 0) {
+                waited(start);
+            }
+        }
+        if (e != 0) {
+            std::string message = "RWLOCK ERROR: Failed to acquire write lock: ";
+            message.append(std::strerror(e));
+            throw std::runtime_error(message);
+        }
+        ++acquisitions;
+    }
+
+    void unlock() {
+        if (pthread_rwlock_unlock(&lock) != 0) {
+            std::string message = "RWLOCK ERROR: Failed to release lock: ";
+            message.append(std::strerror(errno));
+            throw std::runtime_error(message);
+        }
+    }
+
+    // Number of times this lock was acquired, shared or exclusive.
+    size_t getAcquisitions() const {
+        return acquisitions.get();
+    }
+
+    // Number of acquisitions that had to wait for the lock.
+    size_t getContended() const {
+        return contended.get();
+    }
+
+    // Total microseconds spent waiting in contended acquisitions.
+    uint64_t getWaitTime() const {
+        return waitTime.get();
+    }
+
+private:
+    void waited(const struct timeval &start) {
+        ++contended;
+        waitTime += usec_since(start);
+    }
+
+    pthread_rwlock_t lock;
+    Atomic<size_t>   acquisitions;
+    Atomic<size_t>   contended;
+    Atomic<uint64_t> waitTime;
+
+    DISALLOW_COPY_AND_ASSIGN(RWLock);
+};
+
+#endif
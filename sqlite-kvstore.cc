@@ -5,10 +5,34 @@
 #include "sqlite-kvstore.hh"
 #include "sqlite-pst.hh"
 
+// Values carry the protocol's trailing "\r\n" in memory, but are
+// stored without it.
+static size_t storedLength(const std::string &value) {
+    size_t n = value.length();
+    if (n >= 2 && value[n - 2] == '\r' && value[n - 1] == '\n') {
+        n -= 2;
+    }
+    return n;
+}
+
+// Read a stored value straight into the single string that holds it
+// in memory, "\r\n" and all.
+static value_t readValue(PreparedStatement *st, int x) {
+    const char *data = static_cast<const char*>(st->column_blob(x));
+    size_t n = static_cast<size_t>(st->column_bytes(x));
+    std::string *value = new std::string();
+    value->reserve(n + 2);
+    if (n > 0) {
+        value->append(data, n);
+    }
+    value->append("\r\n", 2);
+    return value_t(value);
+}
+
 void StrategicSqlite3::set(const Item &itm, Callback<bool> &cb) {
-    PreparedStatement *ins_stmt = strategy->forKey(itm.getKey())->ins();
+    PreparedStatement *ins_stmt = strategy->forKey(itm.getHash())->ins();
     ins_stmt->bind(1, itm.getKey().c_str());
-    ins_stmt->bind(2, const_cast<Item&>(itm).getData(), itm.getNBytes());
+    ins_stmt->bind(2, itm.getData(), storedLength(*itm.getValue()));
     ins_stmt->bind(3, itm.getFlags());
     ins_stmt->bind(4, itm.getExptime());
     ins_stmt->bind64(5, itm.getCas());
@@ -17,17 +41,24 @@ void StrategicSqlite3::set(const Item &itm, Callback<bool> &cb) {
     ins_stmt->reset();
 }
 
-void StrategicSqlite3::get(const std::string &key, Callback<GetValue> &cb) {
-    PreparedStatement *sel_stmt = strategy->forKey(key)->sel();
+void StrategicSqlite3::get(const std::string &key, uint64_t hash,
+                           Callback<GetValue> &cb) {
+    PreparedStatement *sel_stmt = strategy->forKey(hash)->sel();
     sel_stmt->bind(1, key.c_str());
 
-    if(sel_stmt->fetch()) {
-        GetValue rv(new Item(key.c_str(),
-                             static_cast<uint16_t>(key.length()),
+    bool found;
+    try {
+        found = sel_stmt->fetch();
+    } catch (std::runtime_error &e) {
+        // Leave the statement fit for the next read.
+        sel_stmt->reset();
+        throw;
+    }
+    if (found) {
+        GetValue rv(new Item(key,
                              sel_stmt->column_int(1),
                              sel_stmt->column_int(2),
-                             sel_stmt->column_blob(0),
-                             sel_stmt->column_bytes(0)));
+                             readValue(sel_stmt, 0)));
         cb.callback(rv);
     } else {
         GetValue rv(false);
@@ -36,14 +67,98 @@ void StrategicSqlite3::get(const std::string &key, Callback<GetValue> &cb) {
     sel_stmt->reset();
 }
 
-void StrategicSqlite3::del(const std::string &key, Callback<bool> &cb) {
-    PreparedStatement *del_stmt = strategy->forKey(key)->del();
+void StrategicSqlite3::del(const std::string &key, uint64_t hash,
+                           Callback<bool> &cb) {
+    PreparedStatement *del_stmt = strategy->forKey(hash)->del();
     del_stmt->bind(1, key.c_str());
     bool rv = del_stmt->execute() >= 0;
     cb.callback(rv);
     del_stmt->reset();
 }
 
+void StrategicSqlite3::mutate(const std::vector<Mutation> &batch,
+                              Callback<std::vector<bool> > &cb) {
+    std::vector<bool> rv(batch.size(), false);
+    const std::vector<Statements*> &statements = strategy->allStatements();
+    // Positions in the batch of each shard's deletes and sets, the
+    // same way forKey() picks the shard.
+    std::vector<std::vector<size_t> > deletes(statements.size());
+    std::vector<std::vector<size_t> > sets(statements.size());
+    for (size_t i = 0; i < batch.size(); ++i) {
+        size_t shard = batch[i].hash % statements.size();
+        if (batch[i].deletion) {
+            deletes[shard].push_back(i);
+        } else {
+            sets[shard].push_back(i);
+        }
+    }
+
+    for (size_t shard = 0; shard < statements.size(); ++shard) {
+        deleteRows(statements[shard], batch, deletes[shard], rv);
+        insertRows(statements[shard], batch, sets[shard], rv);
+    }
+    cb.callback(rv);
+}
+
+void StrategicSqlite3::deleteRows(Statements *st,
+                                  const std::vector<Mutation> &batch,
+                                  const std::vector<size_t> &rows,
+                                  std::vector<bool> &rv) {
+    size_t done = 0;
+    while (done < rows.size()) {
+        size_t n = rows.size() - done;
+        PreparedStatement *del_stmt = st->del();
+        if (n >= MULTI_ROW_STATEMENT_ROWS) {
+            n = MULTI_ROW_STATEMENT_ROWS;
+            del_stmt = st->delMany();
+        } else {
+            n = 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const Mutation &m = batch[rows[done + i]];
+            del_stmt->bind(static_cast<int>(i + 1), m.key, m.nkey);
+        }
+        bool success = del_stmt->execute() >= 0;
+        del_stmt->reset();
+        for (size_t i = 0; i < n; ++i) {
+            rv[rows[done + i]] = success;
+        }
+        done += n;
+    }
+}
+
+void StrategicSqlite3::insertRows(Statements *st,
+                                  const std::vector<Mutation> &batch,
+                                  const std::vector<size_t> &rows,
+                                  std::vector<bool> &rv) {
+    size_t done = 0;
+    while (done < rows.size()) {
+        size_t n = rows.size() - done;
+        PreparedStatement *ins_stmt = st->ins();
+        if (n >= MULTI_ROW_STATEMENT_ROWS) {
+            n = MULTI_ROW_STATEMENT_ROWS;
+            ins_stmt = st->insMany();
+        } else {
+            n = 1;
+        }
+        for (size_t i = 0; i < n; ++i) {
+            const Mutation &m = batch[rows[done + i]];
+            int pos = static_cast<int>(i * 5);
+            ins_stmt->bind(pos + 1, m.key, m.nkey);
+            ins_stmt->bind(pos + 2, m.value->data(), storedLength(*m.value));
+            ins_stmt->bind(pos + 3, static_cast<int>(m.flags));
+            ins_stmt->bind(pos + 4, static_cast<int>(m.exptime));
+            ins_stmt->bind64(pos + 5, m.cas);
+        }
+        bool success = ins_stmt->execute() == static_cast<int>(n);
+        ins_stmt->reset();
+        for (size_t i = 0; i < n; ++i) {
+            rv[rows[done + i]] = success;
+        }
+        done += n;
+    }
+}
+
 void StrategicSqlite3::dump(Callback<GetValue> &cb) {
 
     const std::vector<Statements*> statements = strategy->allStatements();
@@ -52,15 +167,74 @@ void StrategicSqlite3::dump(Callback<GetValue> &cb) {
         PreparedStatement *st = (*it)->all();
         st->reset();
         while (st->fetch()) {
-            GetValue rv(new Item(st->column_blob(0),
-                                 static_cast<uint16_t>(st->column_bytes(0)),
+            std::string key(static_cast<const char*>(st->column_blob(0)),
+                            st->column_bytes(0));
+            GetValue rv(new Item(key,
                                  st->column_int(2),
                                  st->column_int(3),
-                                 st->column_blob(1),
-                                 st->column_bytes(1)));
+                                 readValue(st, 1)));
             cb.callback(rv);
         }
 
         st->reset();
     }
 }
+
+// Pass the statement's current row to the callback.  The statements
+// dumpRows() and dumpRowsFrom() use all select k first, and flags and
+// exptime after the value if there is one.
+static void passRow(PreparedStatement *st, bool values,
+                    Callback<DumpedRow> &cb) {
+    int flagsCol = values ? 2 : 1;
+    const char *key = static_cast<const char*>(st->column_blob(0));
+    DumpedRow row(key, st->column_bytes(0),
+                  values ? readValue(st, 1) : value_t(),
+                  st->column_int(flagsCol),
+                  st->column_int(flagsCol + 1));
+    cb.callback(row);
+}
+
+void StrategicSqlite3::dumpRows(Callback<DumpedRow> &cb, bool values) {
+
+    const std::vector<Statements*> statements = strategy->allStatements();
+    std::vector<Statements*>::const_iterator it;
+    for (it = statements.begin(); it != statements.end(); ++it) {
+        PreparedStatement *st = values ? (*it)->all() : (*it)->allKeys();
+        st->reset();
+        while (st->fetch()) {
+            passRow(st, values, cb);
+        }
+
+        st->reset();
+    }
+}
+
+void StrategicSqlite3::dumpRowsFrom(DumpPosition &pos, size_t limit,
+                                    Callback<DumpedRow> &cb, bool values) {
+    const std::vector<Statements*> statements = strategy->allStatements();
+    size_t passed = 0;
+    while (passed < limit && pos.table < statements.size()) {
+        Statements *s = statements[pos.table];
+        PreparedStatement *st = values ? s->allFrom() : s->allKeysFrom();
+        // The rowid follows exptime.
+        int rowidCol = values ? 4 : 3;
+        size_t want = limit - passed;
+        size_t n = 0;
+        st->reset();
+        st->bind64(1, pos.row);
+        st->bind(2, static_cast<int>(want));
+        while (st->fetch()) {
+            pos.row = st->column_int64(rowidCol);
+            passRow(st, values, cb);
+            ++n;
+        }
+        st->reset();
+
+        passed += n;
+        if (n < want) {
+            ++pos.table;
+            pos.row = 0;
+        }
+    }
+    pos.done = pos.table >= statements.size();
+}
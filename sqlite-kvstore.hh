@@ -83,19 +83,62 @@ public:
     /**
      * Overrides get().
      */
-    void get(const std::string &key, Callback<GetValue> &cb);
+    void get(const std::string &key, uint64_t hash, Callback<GetValue> &cb);
 
     /**
      * Overrides del().
      */
-    void del(const std::string &key, Callback<bool> &cb);
+    void del(const std::string &key, uint64_t hash, Callback<bool> &cb);
+
+    /**
+     * Overrides mutate(), grouping the batch by shard and writing
+     * each shard's rows with multi-row statements.
+     */
+    void mutate(const std::vector<Mutation> &batch,
+                Callback<std::vector<bool> > &cb);
+
+    /**
+     * Overrides checkpoint(), for databases in WAL mode.
+     */
+    bool checkpoint() {
+        return strategy->checkpoint();
+    }
+
+    /**
+     * Overrides getLogSize().
+     */
+    size_t getLogSize() {
+        return strategy->getWalSize();
+    }
 
     /**
      * Overrides dump
      */
     virtual void dump(Callback<GetValue> &cb);
 
+    /**
+     * Overrides dumpRows, reading keys straight from the statement.
+     */
+    virtual void dumpRows(Callback<DumpedRow> &cb, bool values = true);
+
+    /**
+     * Overrides dumpRowsFrom, a table at a time in rowid order.  A row
+     * stored again gets a new rowid, so it's passed again later.
+     */
+    virtual void dumpRowsFrom(DumpPosition &pos, size_t limit,
+                              Callback<DumpedRow> &cb, bool values = true);
+
 private:
+    /**
+     * Apply the deletes (or sets) at the given positions of the batch,
+     * all of which belong in the shard with the given statements,
+     * recording in rv whether each succeeded.
+     */
+    void deleteRows(Statements *st, const std::vector<Mutation> &batch,
+                    const std::vector<size_t> &rows, std::vector<bool> &rv);
+    void insertRows(Statements *st, const std::vector<Mutation> &batch,
+                    const std::vector<size_t> &rows, std::vector<bool> &rv);
+
     /**
      * Shortcut to execute a simple query.
      *
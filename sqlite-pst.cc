@@ -82,7 +82,7 @@ const char *PreparedStatement::column(int x) {
 }
 
 const void *PreparedStatement::column_blob(int x) {
-    return (char*)sqlite3_column_text(st, x);
+    return sqlite3_column_blob(st, x);
 }
 
 int PreparedStatement::column_bytes(int x) {
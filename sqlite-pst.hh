@@ -142,6 +142,11 @@ private:
     sqlite3_stmt *st;
 };
 
+// Rows each of a table's multi-row insert and delete statements
+// handles.  Five bound values a row must stay under sqlite's limit of
+// 999.
+#define MULTI_ROW_STATEMENT_ROWS 64
+
 // Container of multiple statements.
 
 class Statements {
@@ -157,7 +162,13 @@ public:
         delete sel_stmt;
         delete del_stmt;
         delete all_stmt;
+        delete all_keys_stmt;
+        delete all_from_stmt;
+        delete all_keys_from_stmt;
+        delete ins_many_stmt;
+        delete del_many_stmt;
         ins_stmt = sel_stmt = del_stmt = NULL;
+        ins_many_stmt = del_many_stmt = NULL;
     }
 
     PreparedStatement *ins() {
@@ -175,6 +186,33 @@ public:
     PreparedStatement *all() {
         return all_stmt;
     }
+
+    // Like all(), without the values.
+    PreparedStatement *allKeys() {
+        return all_keys_stmt;
+    }
+
+    // The rows with a rowid above the one bound first, up to the
+    // number bound second, in rowid order, each followed by its rowid.
+    PreparedStatement *allFrom() {
+        return all_from_stmt;
+    }
+
+    // Like allFrom(), without the values.
+    PreparedStatement *allKeysFrom() {
+        return all_keys_from_stmt;
+    }
+
+    // Insert MULTI_ROW_STATEMENT_ROWS rows, bound like ins() one
+    // after the other.
+    PreparedStatement *insMany() {
+        return ins_many_stmt;
+    }
+
+    // Delete MULTI_ROW_STATEMENT_ROWS keys.
+    PreparedStatement *delMany() {
+        return del_many_stmt;
+    }
 private:
 
     void initStatements() {
@@ -191,8 +229,37 @@ private:
                  "select k, v, flags, exptime, cas "
                  "from %s", tableName.c_str());
         all_stmt = new PreparedStatement(db, buf);
+        snprintf(buf, sizeof(buf),
+                 "select k, flags, exptime "
+                 "from %s", tableName.c_str());
+        all_keys_stmt = new PreparedStatement(db, buf);
+        snprintf(buf, sizeof(buf),
+                 "select k, v, flags, exptime, rowid "
+                 "from %s where rowid > ? order by rowid limit ?",
+                 tableName.c_str());
+        all_from_stmt = new PreparedStatement(db, buf);
+        snprintf(buf, sizeof(buf),
+                 "select k, flags, exptime, rowid "
+                 "from %s where rowid > ? order by rowid limit ?",
+                 tableName.c_str());
+        all_keys_from_stmt = new PreparedStatement(db, buf);
         snprintf(buf, sizeof(buf), "delete from %s where k = ?", tableName.c_str());
         del_stmt = new PreparedStatement(db, buf);
+
+        // This sqlite predates multi-row values lists, so insert from
+        // a compound select.
+        std::string q("insert into " + tableName
+                      + " (k, v, flags, exptime, cas) select ?, ?, ?, ?, ?");
+        for (int i = 1; i < MULTI_ROW_STATEMENT_ROWS; ++i) {
+            q.append(" union all select ?, ?, ?, ?, ?");
+        }
+        ins_many_stmt = new PreparedStatement(db, q.c_str());
+        q = "delete from " + tableName + " where k in (?";
+        for (int i = 1; i < MULTI_ROW_STATEMENT_ROWS; ++i) {
+            q.append(", ?");
+        }
+        q.append(")");
+        del_many_stmt = new PreparedStatement(db, q.c_str());
     }
 
     sqlite3           *db;
@@ -201,6 +268,11 @@ private:
     PreparedStatement *sel_stmt;
     PreparedStatement *del_stmt;
     PreparedStatement *all_stmt;
+    PreparedStatement *all_keys_stmt;
+    PreparedStatement *all_from_stmt;
+    PreparedStatement *all_keys_from_stmt;
+    PreparedStatement *ins_many_stmt;
+    PreparedStatement *del_many_stmt;
 
     DISALLOW_COPY_AND_ASSIGN(Statements);
 };
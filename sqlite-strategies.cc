@@ -1,7 +1,11 @@
 /* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 
+#include <sys/stat.h>
+#include <strings.h>
+#include <algorithm>
 #include <cassert>
 #include <iostream>
+#include <sstream>
 #include <stdexcept>
 
 #include "sqlite-strategies.hh"
@@ -10,10 +14,14 @@
 
 sqlite3 *SqliteStrategy::open(void) {
     if(!db) {
-        if(sqlite3_open(filename, &db) !=  SQLITE_OK) {
+        if(sqlite3_open(filename.c_str(), &db) !=  SQLITE_OK) {
             throw std::runtime_error("Error initializing sqlite3");
         }
 
+        // Each flusher writes its shard on its own connection, so
+        // wait out their locks rather than fail.
+        sqlite3_busy_timeout(db, SQLITE_BUSY_TIMEOUT_MS);
+
         if(sqlite3_extended_result_codes(db, 1) != SQLITE_OK) {
             throw std::runtime_error("Error enabling extended RCs");
         }
@@ -30,6 +38,7 @@ void SqliteStrategy::close(void) {
         destroyStatements();
         sqlite3_close(db);
         db = NULL;
+        walDatabases.clear();
     }
 }
 
@@ -41,14 +50,72 @@ void SqliteStrategy::destroyStatements() {
     }
 }
 
+// Columns of a kv table.  Values are stored as blobs, without the
+// "\r\n" they carry in memory.
+#define KV_TABLE_COLUMNS \
+    " (k varchar(250) primary key on conflict replace," \
+    "  v blob," \
+    "  flags integer," \
+    "  exptime integer," \
+    "  cas integer)"
+
+// Version of the kv table layout, recorded in each database's
+// user_version.  0 stored values as text with their "\r\n".
+#define KV_SCHEMA_VERSION 1
+
 void SqliteStrategy::initTables(void) {
     assert(db);
-    execute("create table if not exists kv"
-            " (k varchar(250) primary key on conflict replace,"
-            "  v text,"
-            "  flags integer,"
-            "  exptime integer,"
-            "  cas integer)");
+    execute("create table if not exists kv" KV_TABLE_COLUMNS);
+    upgradeSchema("main", filename);
+}
+
+void SqliteStrategy::upgradeSchema(const char *schema,
+                                   const std::string &file) {
+    char buf[1024];
+    snprintf(buf, sizeof(buf), "pragma %s.user_version", schema);
+    {
+        PreparedStatement st(db, buf);
+        if (st.fetch() && st.column_int(0) >= KV_SCHEMA_VERSION) {
+            return;
+        }
+    }
+
+    // A table that was just created already has the new layout.
+    snprintf(buf, sizeof(buf),
+             "select count(*) from %s.sqlite_master"
+             " where name = 'kv' and sql like '%% v blob,%%'", schema);
+    bool current;
+    {
+        PreparedStatement st(db, buf);
+        current = st.fetch() && st.column_int(0) > 0;
+    }
+    if (current) {
+        snprintf(buf, sizeof(buf), "pragma %s.user_version = %d",
+                 schema, KV_SCHEMA_VERSION);
+        execute(buf);
+        return;
+    }
+
+    getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                     "Converting the values in %s to blobs\n", file.c_str());
+    execute("begin");
+    snprintf(buf, sizeof(buf), "alter table %s.kv rename to kv_text", schema);
+    execute(buf);
+    snprintf(buf, sizeof(buf), "create table %s.kv" KV_TABLE_COLUMNS, schema);
+    execute(buf);
+    snprintf(buf, sizeof(buf),
+             "insert into %s.kv (k, v, flags, exptime, cas)"
+             " select k, case when substr(cast(v as blob), -2) = x'0d0a'"
+             " then substr(cast(v as blob), 1, length(cast(v as blob)) - 2)"
+             " else cast(v as blob) end,"
+             " flags, exptime, cas from %s.kv_text", schema, schema);
+    execute(buf);
+    snprintf(buf, sizeof(buf), "drop table %s.kv_text", schema);
+    execute(buf);
+    snprintf(buf, sizeof(buf), "pragma %s.user_version = %d",
+             schema, KV_SCHEMA_VERSION);
+    execute(buf);
+    execute("commit");
 }
 
 void SqliteStrategy::initStatements(void) {
@@ -68,6 +135,7 @@ void SqliteStrategy::initPragmas(void) {
                          "Initializing DB session from %s\n", initFile);
         eval.eval(initFile);
     }
+    setJournalMode("main", filename);
 }
 
 void SqliteStrategy::execute(const char * const query) {
@@ -75,27 +143,151 @@ void SqliteStrategy::execute(const char * const query) {
     st.execute();
 }
 
+void SqliteStrategy::setJournalMode(const char *schema,
+                                    const std::string &file) {
+    if (!journalMode) {
+        return;
+    }
+    char buf[256];
+    snprintf(buf, sizeof(buf), "pragma %s.journal_mode = %s",
+             schema, journalMode);
+    PreparedStatement st(db, buf);
+    // The pragma answers with the mode the database is in now, which
+    // is unchanged if this sqlite doesn't support the one asked for.
+    std::string mode(st.fetch() ? st.column(0) : "");
+    if (strcasecmp(mode.c_str(), journalMode) != 0) {
+        getLogger()->log(EXTENSION_LOG_WARNING, NULL,
+                         "Couldn't put %s in journal mode %s; it's in %s\n",
+                         file.c_str(), journalMode, mode.c_str());
+    }
+    if (strcasecmp(mode.c_str(), "wal") == 0) {
+        // Checkpoints are left to checkpoint() so they can be timed
+        // to stay out of the way of commits.
+        execute("pragma wal_autocheckpoint = 0");
+        std::pair<std::string, std::string> wal(schema, file);
+        if (std::find(walDatabases.begin(), walDatabases.end(), wal)
+            == walDatabases.end()) {
+            walDatabases.push_back(wal);
+        }
+    }
+}
+
+bool SqliteStrategy::checkpoint(void) {
+    if (walDatabases.empty()) {
+        return false;
+    }
+    char buf[256];
+    std::vector<std::pair<std::string, std::string> >::iterator it;
+    for (it = walDatabases.begin(); it != walDatabases.end(); ++it) {
+        // Without an argument, this is a passive checkpoint: it copies
+        // what it can without blocking, so running it often keeps each
+        // one small.
+        snprintf(buf, sizeof(buf), "pragma %s.wal_checkpoint",
+                 it->first.c_str());
+        execute(buf);
+    }
+    return true;
+}
+
+size_t SqliteStrategy::getWalSize(void) const {
+    size_t rv(0);
+    std::vector<std::pair<std::string, std::string> >::const_iterator it;
+    for (it = walDatabases.begin(); it != walDatabases.end(); ++it) {
+        struct stat st;
+        if (stat((it->second + "-wal").c_str(), &st) == 0) {
+            rv += static_cast<size_t>(st.st_size);
+        }
+    }
+    return rv;
+}
+
 //
 // ----------------------------------------------------------------------
 // Multi DB strategy
 // ----------------------------------------------------------------------
 //
 
+// Version of the key to shard mapping recorded in shard_meta.
+#define SHARD_HASH_VERSION 1
+
+extern "C" {
+    // SQL function ep_shard(k): the shard a key belongs in.
+    static void shardFunction(sqlite3_context *ctx, int argc,
+                              sqlite3_value **argv) {
+        assert(argc == 1);
+        int numTables = *static_cast<int*>(sqlite3_user_data(ctx));
+        const char *k = static_cast<const char*>(sqlite3_value_blob(argv[0]));
+        size_t nk = static_cast<size_t>(sqlite3_value_bytes(argv[0]));
+        sqlite3_result_int(ctx, static_cast<int>(hashKey(k, nk) % numTables));
+    }
+}
+
+std::string MultiDBSqliteStrategy::shardFile(int i) const {
+    std::stringstream ss;
+    ss << filename << "-" << i << ".sqlite";
+    return ss.str();
+}
+
 void MultiDBSqliteStrategy::initTables() {
     char buf[1024];
     for (int i = 0; i < numTables; i++) {
-        snprintf(buf, sizeof(buf), "attach database \"%s-%d.sqlite\" as kv_%d",
-                 filename, i, i);
+        snprintf(buf, sizeof(buf), "attach database \"%s\" as kv_%d",
+                 shardFile(i).c_str(), i);
+        execute(buf);
+        snprintf(buf, sizeof(buf),
+                 "create table if not exists kv_%d.kv" KV_TABLE_COLUMNS, i);
         execute(buf);
+        snprintf(buf, sizeof(buf), "kv_%d", i);
+        upgradeSchema(buf, shardFile(i));
+        setJournalMode(buf, shardFile(i));
+    }
+    reshard();
+}
+
+/**
+ * Shards written before keys were placed by hashKey() hold rows that
+ * forKey() now looks for elsewhere.  Move every such row to its shard
+ * once, and record in the main database that it has been done.
+ */
+void MultiDBSqliteStrategy::reshard() {
+    execute("create table if not exists shard_meta (version integer)");
+    {
+        PreparedStatement st(db, "select max(version) from shard_meta");
+        if (st.fetch() && st.column_int(0) >= SHARD_HASH_VERSION) {
+            return;
+        }
+    }
+
+    getLogger()->log(EXTENSION_LOG_INFO, NULL,
+                     "Moving rows to their shards for hash version %d\n",
+                     SHARD_HASH_VERSION);
+
+    if (sqlite3_create_function(db, "ep_shard", 1, SQLITE_UTF8, &numTables,
+                                shardFunction, NULL, NULL) != SQLITE_OK) {
+        throw std::runtime_error("Error registering ep_shard()");
+    }
+
+    char buf[1024];
+    execute("begin");
+    for (int i = 0; i < numTables; i++) {
+        for (int j = 0; j < numTables; j++) {
+            if (i == j) {
+                continue;
+            }
+            snprintf(buf, sizeof(buf),
+                     "insert into kv_%d.kv (k, v, flags, exptime, cas)"
+                     " select k, v, flags, exptime, cas from kv_%d.kv"
+                     " where ep_shard(k) = %d", j, i, j);
+            execute(buf);
+        }
         snprintf(buf, sizeof(buf),
-                 "create table if not exists kv_%d.kv"
-                 " (k varchar(250) primary key on conflict replace,"
-                 "  v text,"
-                 "  flags integer,"
-                 "  exptime integer,"
-                 "  cas integer)", i);
+                 "delete from kv_%d.kv where ep_shard(k) != %d", i, i);
         execute(buf);
     }
+    snprintf(buf, sizeof(buf), "insert into shard_meta (version) values(%d)",
+             SHARD_HASH_VERSION);
+    execute(buf);
+    execute("commit");
 }
 
 void MultiDBSqliteStrategy::initStatements() {
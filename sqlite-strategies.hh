@@ -3,17 +3,31 @@
 #define SQLITE_STRATEGIES_H 1
 
 #include <cstdlib>
+#include <string>
 #include <vector>
 
 #include "common.hh"
+#include "hash.hh"
 #include "sqlite-pst.hh"
 
+// Milliseconds a connection waits for another connection's lock on a
+// database before giving up with SQLITE_BUSY.
+#define SQLITE_BUSY_TIMEOUT_MS 10000
+
 class SqliteStrategy {
 public:
 
-    SqliteStrategy(const char * const fn, const char * const finit = NULL) :
+    /**
+     * @param fn the database file
+     * @param finit optional SQL script to run on opening it
+     * @param jmode optional journal mode to put every database the
+     *              connection uses in, such as "wal"
+     */
+    SqliteStrategy(const char * const fn, const char * const finit = NULL,
+                   const char * const jmode = NULL) :
         filename(fn),
         initFile(finit),
+        journalMode(jmode),
         db(NULL),
         statements()
     { }
@@ -26,17 +40,13 @@ public:
         return statements;
     }
 
-    Statements *forKey(const std::string &key) {
+    /**
+     * Get the statements for the shard holding keys with the given
+     * hash (see hashKey()).
+     */
+    Statements *forKey(uint64_t hash) {
         assert(statements.size() > 0);
-        int h=5381;
-        int i=0;
-        const char *str = key.c_str();
-
-        for(i=0; str[i] != 0x00; i++) {
-            h = ((h << 5) + h) ^ str[i];
-        }
-
-        return statements.at(std::abs(h) % (int)statements.size());
+        return statements[hash % statements.size()];
     }
 
     virtual void initTables(void);
@@ -47,14 +57,40 @@ public:
 
     void execute(const char * const query);
 
+    /**
+     * Checkpoint the write-ahead log of each database in WAL mode,
+     * without waiting on readers or writers.
+     *
+     * @return false if no database is in WAL mode
+     */
+    bool checkpoint(void);
+
+    // Bytes in the write-ahead logs of the databases in WAL mode.
+    size_t getWalSize(void) const;
+
     sqlite3 *open(void);
     void close(void);
 
 protected:
-    const char * const filename;
+    /**
+     * Bring the kv table of the named database (main or an attached
+     * one), stored in the given file, up to the current schema.
+     */
+    void upgradeSchema(const char *schema, const std::string &file);
+
+    /**
+     * Put the named database (main or an attached one), stored in the
+     * given file, in the configured journal mode.
+     */
+    void setJournalMode(const char *schema, const std::string &file);
+
+    const std::string filename;
     const char * const initFile;
+    const char * const journalMode;
     sqlite3 *db;
     std::vector<Statements *> statements;
+    // Name and file of each database in WAL mode.
+    std::vector<std::pair<std::string, std::string> > walDatabases;
 
 private:
     DISALLOW_COPY_AND_ASSIGN(SqliteStrategy);
@@ -70,8 +106,9 @@ class MultiDBSqliteStrategy : public SqliteStrategy {
 public:
     MultiDBSqliteStrategy(const char * const fn,
                           const char * const finit = NULL,
-                          int n=4):
-        SqliteStrategy(fn, finit),
+                          int n=4,
+                          const char * const jmode = NULL):
+        SqliteStrategy(fn, finit, jmode),
         numTables(n)
     {}
 
@@ -79,7 +116,19 @@ public:
     void initStatements(void);
     void destroyTables(void);
 
+    int getNumShards() const {
+        return numTables;
+    }
+
+    /**
+     * The file holding the given shard.  A plain SqliteStrategy on it
+     * reads and writes that shard on a connection of its own.
+     */
+    std::string shardFile(int i) const;
+
 private:
+    void reshard(void);
+
     int numTables;
 };
 
@@ -16,6 +16,13 @@ public:
     Atomic<bool> warmupComplete;
     // Number of records warmed up.
     Atomic<size_t> warmedUp;
+    // Whether every key on disk has been loaded, if not its value.
+    Atomic<bool> keysLoaded;
+    // Rows loaded in the background after warmup.
+    Atomic<size_t> backgroundLoaded;
+    // Number of access logs written, and the keys in the last one.
+    Atomic<size_t> accessScannerRuns;
+    Atomic<size_t> accessLogKeys;
     // size of the input queue
     Atomic<size_t> queue_size;
     // Size of the in-process (output) queue.
@@ -43,14 +50,70 @@ public:
     Atomic<rel_time_t> flushDurationHighWat;
     // Amount of time spent in the commit phase.
     Atomic<rel_time_t> commit_time;
+    // Milliseconds the most recent commit took.
+    Atomic<size_t> commitTimeMs;
+    // Items the most recent transaction was allowed to write.
+    Atomic<size_t> txnSize;
+    // Number of write-ahead log checkpoints, and how long the most
+    // recent one took (ms).
+    Atomic<size_t> checkpoints;
+    Atomic<size_t> checkpointTimeMs;
     // Total number of items; this would be total_items if we recycled
     // items, but we don't right now.
     Atomic<size_t> curr_items;
+    // Number of times a value was ejected from memory.
+    Atomic<size_t> numValueEjects;
+    // Number of ejected values read back in from disk.
+    Atomic<size_t> bgFetched;
+    // Number of background fetches that joined one already running.
+    Atomic<size_t> bgFetchCoalesced;
+    // Number of keys missing from memory that were read in from disk
+    // on a get.
+    Atomic<size_t> missFetched;
+    // Number of background fetches given up on after failed reads.
+    Atomic<size_t> bgFetchFailed;
+    // Number of writes whose connections are waiting for them to be
+    // committed.
+    Atomic<size_t> persistWaiting;
+    // Number of connections notified that their writes were committed.
+    Atomic<size_t> persistNotified;
+    // Number of times writes started being refused for the flusher
+    // to catch up, and the number of writes refused.
+    Atomic<size_t> throttlePeriods;
+    Atomic<size_t> throttledWrites;
+    // Number of expired items removed, by gets or by the expiry pager.
+    Atomic<size_t> expired;
+    // Number of expired items the expiry pager removed.
+    Atomic<size_t> expiryPagerExpired;
+    // Number of complete passes of the expiry pager.
+    Atomic<size_t> expiryPagerRuns;
+    // Lock stripes the running expiry pager pass has looked at.
+    Atomic<size_t> expiryPagerStripesDone;
     // Beyond this point are config items
     // Minimum data age before a record can be persisted
     Atomic<int> min_data_age;
     // Maximum data age before a record is forced to be persisted
     Atomic<int> queue_age_cap;
+    // Memory quota for stored items (0 for no quota).
+    Atomic<size_t> maxDataSize;
+    // Start ejecting values when memory use goes above this...
+    Atomic<size_t> mem_high_wat;
+    // ...and stop once it's back below this.
+    Atomic<size_t> mem_low_wat;
+    // Seconds between passes of the expiry pager.
+    Atomic<size_t> exp_pager_stime;
+    // Commit time adaptive transaction sizing aims for (ms; 0 for off).
+    Atomic<size_t> txn_commit_target;
+    // Queued items and their bytes that start refusing writes (0 for
+    // no limit), and that they must be back under to stop.
+    Atomic<size_t> queue_high_wat;
+    Atomic<size_t> queue_low_wat;
+    Atomic<size_t> dirty_high_wat;
+    Atomic<size_t> dirty_low_wat;
+    // Seconds between checkpoints of each write-ahead log.
+    Atomic<size_t> checkpoint_interval;
+    // Seconds between writes of the access log.
+    Atomic<size_t> access_log_interval;
     // Current tap queue size.
     Atomic<size_t> tap_queue;
     // Total number of tap messages sent.
@@ -3,9 +3,19 @@
 #define STORED_VALUE_H 1
 
 #include <climits>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <new>
+#include <vector>
 
 #include "locks.hh"
+#include "rwlock.hh"
+#include "atomic.hh"
+#include "hash.hh"
+
+#define DEFAULT_HT_SIZE 196613
+#define DEFAULT_HT_LOCKS 193
 
 extern "C" {
     extern rel_time_t (*ep_current_time)();
@@ -14,40 +24,53 @@ extern "C" {
 // Forward declaration for StoredValue
 class HashTable;
 
+/**
+ * An item in the hash table.
+ *
+ * StoredValues are variable length: the key is kept inline after the
+ * fixed fields, so an item costs one allocation besides its value.
+ * Use create() and destroy() rather than new and delete.
+ */
 class StoredValue {
 public:
-    StoredValue(const Item &itm, StoredValue *n) :
-        key(itm.getKey()), value(itm.getValue()),
-        flags(itm.getFlags()), exptime(itm.getExptime()), dirtied(0), next(n),
-        cas(itm.getCas()), locked(false), lock_expiry(0)
-    {
-        markDirty();
+
+    static StoredValue *create(const Item &itm, StoredValue *n,
+                               bool setDirty = true) {
+        assert(itm.getKey().size() <= MAX_KEY_LEN);
+        void *mem = ::operator new(allocSize(itm.getKey().size()));
+        return new (mem) StoredValue(itm, n, setDirty);
     }
 
-    StoredValue(const Item &itm, StoredValue *n, bool setDirty) :
-        key(itm.getKey()), value(itm.getValue()),
-        flags(itm.getFlags()), exptime(itm.getExptime()), dirtied(0), next(n),
-        cas(itm.getCas())
-    {
-        if (setDirty) {
-            markDirty();
-        } else {
-            markClean(NULL, NULL);
-        }
+    /**
+     * A clean value straight from a row of the persistent store, with
+     * no CAS yet; HashTable::addBatch() assigns one.  A NULL value
+     * makes it non-resident.
+     */
+    static StoredValue *create(const char *key, size_t nkey, uint64_t hash,
+                               value_t val, uint32_t flags,
+                               rel_time_t exptime) {
+        assert(nkey <= MAX_KEY_LEN);
+        void *mem = ::operator new(allocSize(nkey));
+        return new (mem) StoredValue(key, nkey, hash, val, flags, exptime);
     }
 
-    ~StoredValue() {
+    static void destroy(StoredValue *v) {
+        v->~StoredValue();
+        ::operator delete(v);
     }
+
     void markDirty() {
         data_age = ep_current_time();
         if (!isDirty()) {
             dirtied = data_age;
+            bits |= DIRTY;
         }
     }
 
     void reDirty(rel_time_t dirtyAge, rel_time_t dataAge) {
         data_age = dataAge;
         dirtied = dirtyAge;
+        bits |= DIRTY;
     }
 
     // returns time this object was dirtied.
@@ -60,28 +83,103 @@ public:
         }
         dirtied = 0;
         data_age = 0;
+        bits &= ~DIRTY;
     }
 
     bool isDirty() const {
-        return dirtied != 0;
+        return bits & DIRTY;
     }
 
     bool isClean() const {
-        return dirtied == 0;
+        return !isDirty();
+    }
+
+    std::string getKey() const {
+        return std::string(keyBytes, keyLen);
+    }
+
+    // The key, in place; it never changes for as long as this lives.
+    const char *getKeyBytes() const {
+        return keyBytes;
+    }
+
+    size_t getKeyLen() const {
+        return keyLen;
+    }
+
+    // Whether this key sorts before the other's, bytewise like the
+    // keys in the persistent store.
+    bool keyLess(const StoredValue &other) const {
+        int rv = std::memcmp(keyBytes, other.keyBytes,
+                             std::min(keyLen, other.keyLen));
+        return rv < 0 || (rv == 0 && keyLen < other.keyLen);
+    }
+
+    bool hasKey(const std::string &k) const {
+        return hasKey(k.data(), k.size());
     }
 
-    const std::string &getKey() const {
-        return key;
+    bool hasKey(const char *k, size_t nk) const {
+        return nk == keyLen && std::memcmp(k, keyBytes, keyLen) == 0;
+    }
+
+    uint64_t getHash() const {
+        return hash;
     }
 
     value_t getValue() const {
         return value;
     }
 
+    /**
+     * True if the value is in memory; false if it was ejected and
+     * only lives in the persistent store.
+     */
+    bool isResident() const {
+        return value.get() != NULL;
+    }
+
+    // Approximate bytes of memory held by this object, its key and
+    // (if resident) its value.
+    size_t size() const {
+        return metaDataSize() + kvSize();
+    }
+
+    // Bytes of key and value data.
+    size_t kvSize() const {
+        return keyLen + valueSize();
+    }
+
+    /**
+     * Bytes held on top of the key and value data: this object, the
+     * string and reference count around the value, unused string
+     * capacity and the allocator's own per-chunk overhead.
+     */
+    size_t metaDataSize() const {
+        size_t rv = mallocSize(allocSize(keyLen)) - keyLen;
+        if (isResident()) {
+            // A shared_ptr's count lives in its own chunk of about
+            // four words.
+            rv += mallocSize(sizeof(std::string))
+                + mallocSize(4 * sizeof(void*))
+                + stringOverhead(*value);
+        }
+        return rv;
+    }
+
+    size_t valueSize() const {
+        return isResident() ? value->length() : 0;
+    }
+
     rel_time_t getExptime() const {
         return exptime;
     }
 
+    // True if the item has an expiry time and it's not after asOf.
+    bool isExpired(rel_time_t asOf) const {
+        return exptime != 0 && exptime <= asOf;
+    }
+
     uint32_t getFlags() const {
         return flags;
     }
@@ -113,37 +211,154 @@ public:
     }
 
     void lock(rel_time_t expiry) {
-        locked = true;
+        bits |= LOCKED;
         lock_expiry = expiry;
     }
 
     void unlock() {
-        locked = false;
+        bits &= ~LOCKED;
         lock_expiry = 0;
     }
 
     bool isLocked(rel_time_t curtime)  {
-        if (locked && (curtime > lock_expiry)) {
-            locked = false;
-            return locked;
+        if ((bits & LOCKED) && (curtime > lock_expiry)) {
+            unlock();
+        }
+        return bits & LOCKED;
+    }
+
+    // Like isLocked(), but safe under a shared stripe lock: an
+    // expired lock is left for the next writer to clear.
+    bool isLockedNow(rel_time_t curtime) const {
+        return (bits & LOCKED) && curtime <= lock_expiry;
+    }
+
+    /**
+     * True while this object is on the persistence queue.  A queued
+     * object that's removed from the hash table is marked deleted
+     * instead of being destroyed, and whoever takes it off the queue
+     * destroys it.  Only change this with the stripe lock held.
+     */
+    bool isQueued() const {
+        return bits & QUEUED;
+    }
+
+    void setQueued(bool queued) {
+        if (queued) {
+            bits |= QUEUED;
+        } else {
+            bits &= ~QUEUED;
         }
-        return locked;
     }
 
+    // True if this object was removed from the hash table while queued.
+    bool isDeleted() const {
+        return bits & DELETED;
+    }
+
+    /**
+     * Note that the object was used since the access scanner last
+     * looked.  Readers set this under a shared stripe lock, alongside
+     * each other and the scanner, so it's atomic; it's only written
+     * when it isn't set yet, to keep gets of hot items from all
+     * writing the same cache line.
+     */
+    void markReferenced() {
+        if (!referenced.get()) {
+            referenced.cas(0, 1);
+        }
+    }
+
+    bool isReferenced() const {
+        return referenced.get();
+    }
+
+    void clearReferenced() {
+        referenced.set(0);
+    }
+
+    // Longest key a StoredValue can hold.
+    static const size_t MAX_KEY_LEN = 0xffff;
+
 private:
 
+    // StoredValue::bits
+    static const uint8_t DIRTY      = 0x01;
+    static const uint8_t LOCKED     = 0x02;
+    static const uint8_t QUEUED     = 0x04;
+    static const uint8_t DELETED    = 0x08;
+
+    StoredValue(const Item &itm, StoredValue *n, bool setDirty) :
+        value(itm.getValue()), next(n), hash(itm.getHash()),
+        cas(itm.getCas()), flags(itm.getFlags()), exptime(itm.getExptime()),
+        dirtied(0), data_age(0), lock_expiry(0),
+        keyLen(static_cast<uint16_t>(itm.getKey().size())), bits(0),
+        referenced(0)
+    {
+        std::memcpy(keyBytes, itm.getKey().data(), keyLen);
+        if (setDirty) {
+            markDirty();
+        }
+    }
+
+    StoredValue(const char *key, size_t nkey, uint64_t h, value_t val,
+                uint32_t fl, rel_time_t exp) :
+        value(val), next(NULL), hash(h), cas(0), flags(fl), exptime(exp),
+        dirtied(0), data_age(0), lock_expiry(0),
+        keyLen(static_cast<uint16_t>(nkey)), bits(0), referenced(0)
+    {
+        std::memcpy(keyBytes, key, keyLen);
+    }
+
+    ~StoredValue() {
+    }
+
+    // Bytes to allocate for a StoredValue with a key of the given
+    // length.
+    static size_t allocSize(size_t keylen) {
+        return std::max(sizeof(StoredValue),
+                        sizeof(StoredValue) - sizeof(keyBytes) + keylen);
+    }
+
+    // Bytes a malloc of n bytes really takes, assuming a
+    // dlmalloc-style allocator: a word of header, rounded up to two
+    // words, four words at least.
+    static size_t mallocSize(size_t n) {
+        const size_t align = 2 * sizeof(size_t);
+        size_t rv = (n + sizeof(size_t) + align - 1) & ~(align - 1);
+        return std::max(rv, 2 * align);
+    }
+
+    // Bytes a string uses on top of its characters, not counting
+    // the string object itself.
+    static size_t stringOverhead(const std::string &s) {
+        const char *p = s.data();
+        const char *self = reinterpret_cast<const char*>(&s);
+        if (p >= self && p < self + sizeof(std::string)) {
+            return 0;           // stored inline in the string object
+        }
+        return mallocSize(s.capacity() + 1) - s.size();
+    }
+
     friend class HashTable;
 
-    std::string key;
+    // Widest fields first, so the only padding is after the key.
     value_t value;
+    StoredValue *next;
+    uint64_t hash;
+    uint64_t cas;
     uint32_t flags;
     rel_time_t exptime;
     rel_time_t dirtied;
     rel_time_t data_age;
-    StoredValue *next;
-    uint64_t cas;
-    bool locked;
     rel_time_t lock_expiry;
+    uint16_t keyLen;
+    uint8_t bits;
+    // Whether it was used since the access scanner last looked.
+    Atomic<uint8_t> referenced;
+    // The key, allocated past the end of the object.
+    char keyBytes[1];
+
     DISALLOW_COPY_AND_ASSIGN(StoredValue);
 };
 
@@ -155,6 +370,18 @@ class HashTableVisitor {
 public:
     virtual ~HashTableVisitor() {}
     virtual void visit(StoredValue *v) = 0;
+    // Checked between lock stripes; return false to end the visit early.
+    virtual bool shouldContinue() { return true; }
+};
+
+/**
+ * Decides which of the values passed to HashTable::addBatch() are
+ * added.  It's asked under the value's stripe lock.
+ */
+class HashTableLoadFilter {
+public:
+    virtual ~HashTableLoadFilter() {}
+    virtual bool shouldAdd(const StoredValue *v) = 0;
 };
 
 class HashTableDepthVisitor {
@@ -181,54 +408,234 @@ public:
     int max;
 };
 
+/**
+ * How a HashTable lays out its buckets.
+ */
+typedef enum {
+    /** Each bucket is a linked list threaded through StoredValue::next. */
+    HT_CHAINED,
+    /**
+     * Each bucket is a cache line of one-byte hash tags and pointers,
+     * so most mismatches are rejected without touching the values.
+     */
+    HT_TAGGED
+} hash_table_layout_t;
+
+/**
+ * A cache line worth of slots of a HT_TAGGED bucket.  The first group
+ * of a bucket lives in the bucket array itself, overflow groups are
+ * chained on through next.
+ */
+class HashSlotGroup {
+public:
+    static const int NSLOTS = 6;
+
+    HashSlotGroup() : used(0), next(NULL) { }
+
+    uint8_t        tags[NSLOTS];
+    uint8_t        used;
+    StoredValue   *slots[NSLOTS];
+    HashSlotGroup *next;
+};
+
+/**
+ * How a HashTable guards its lock stripes.
+ */
+typedef enum {
+    /** Every access, read or write, takes the stripe's Mutex. */
+    HT_LOCK_MUTEX,
+    /** Lookups share the stripe's RWLock; mutations take it exclusively. */
+    HT_LOCK_RWLOCK
+} hash_table_lock_t;
+
+/**
+ * The lock covering one stripe of a HashTable's buckets.
+ */
+class HashStripeLock {
+public:
+    HashStripeLock() : type(HT_LOCK_MUTEX) { }
+
+    void setType(hash_table_lock_t t) {
+        type = t;
+    }
+
+    void acquire() {
+        if (type == HT_LOCK_RWLOCK) {
+            rwlock.writeLock();
+        } else {
+            mutex.acquire();
+        }
+    }
+
+    void acquireShared() {
+        if (type == HT_LOCK_RWLOCK) {
+            rwlock.readLock();
+        } else {
+            mutex.acquire();
+        }
+    }
+
+    // Release either kind of hold.
+    void release() {
+        if (type == HT_LOCK_RWLOCK) {
+            rwlock.unlock();
+        } else {
+            mutex.release();
+        }
+    }
+
+    size_t getAcquisitions() const {
+        return type == HT_LOCK_RWLOCK
+            ? rwlock.getAcquisitions() : mutex.getAcquisitions();
+    }
+
+    size_t getContended() const {
+        return type == HT_LOCK_RWLOCK
+            ? rwlock.getContended() : mutex.getContended();
+    }
+
+    // Total microseconds spent waiting for this stripe.
+    uint64_t getWaitTime() const {
+        return type == HT_LOCK_RWLOCK
+            ? rwlock.getWaitTime() : mutex.getWaitTime();
+    }
+
+private:
+    Mutex             mutex;
+    RWLock            rwlock;
+    hash_table_lock_t type;
+
+    DISALLOW_COPY_AND_ASSIGN(HashStripeLock);
+};
+
+/**
+ * Holds a HashStripeLock for the current scope, exclusively unless
+ * asked for a shared hold.  Callers holding a shared lock must not
+ * modify the values they find.
+ */
+class StripeLockHolder {
+public:
+    StripeLockHolder(HashStripeLock &l, bool s = false) :
+        stripe(l), shared(s), locked(false) {
+        lock();
+    }
+
+    ~StripeLockHolder() {
+        unlock();
+    }
+
+    void lock() {
+        if (shared) {
+            stripe.acquireShared();
+        } else {
+            stripe.acquire();
+        }
+        locked = true;
+    }
+
+    void unlock() {
+        if (locked) {
+            stripe.release();
+            locked = false;
+        }
+    }
+
+private:
+    HashStripeLock &stripe;
+    bool            shared;
+    bool            locked;
+
+    DISALLOW_COPY_AND_ASSIGN(StripeLockHolder);
+};
+
+/**
+ * A lock-striped hash table of StoredValues.
+ *
+ * The table can be resized online.  A resize allocates a new bucket
+ * array and then migrates the old buckets into it a few at a time,
+ * each migration happening under the lock stripe that already covers
+ * the bucket.  Both bucket counts are kept multiples of the number of
+ * locks, so a key maps to the same lock stripe in the old and the new
+ * table and lookups stay correct while a resize is in flight.
+ *
+ * With HT_LOCK_RWLOCK, lookups through find() and callers taking a
+ * shared StripeLockHolder run concurrently with each other and only
+ * serialize against mutations of the same stripe.
+ */
 class HashTable {
 public:
 
     // Construct with number of buckets and locks.
-    HashTable(size_t s = 196613, size_t l = 193) {
-        size = s;
+    HashTable(size_t s = DEFAULT_HT_SIZE, size_t l = DEFAULT_HT_LOCKS,
+              hash_table_layout_t lay = HT_CHAINED,
+              hash_table_lock_t lt = HT_LOCK_MUTEX) {
+        assert(l > 0);
         n_locks = l;
+        layout = lay;
+        lockType = lt;
+        minSize = roundSize(s);
         active = true;
-        values = new StoredValue*[s];
-        std::fill_n(values, s, static_cast<StoredValue*>(NULL));
-        mutexes = new Mutex[l];
-        depths = new int[s];
-        std::fill_n(depths, s, 0);
+        resizing = false;
+        allocTable(current, minSize);
+        allocTable(old, 0);
+        allocStripes(lt);
+        migrated = new size_t[l];
+        std::fill_n(migrated, l, static_cast<size_t>(0));
+        resizeCursor = 0;
+        numItems.set(0);
+        numNonResident.set(0);
+        memSize.set(0);
+        kvSize.set(0);
+        dirtySize.set(0);
+        numResizes.set(0);
+        resizeBucketsDone.set(0);
+        resizeBucketsTotal.set(0);
     }
 
     ~HashTable() {
         clear();
-        delete []mutexes;
-        delete []values;
-        delete []depths;
+        freeStripes();
+        freeTable(current);
+        freeTable(old);
+        delete []migrated;
     }
 
     void clear() {
         assert(active);
-        for (int i = 0; i < (int)size; i++) {
-            LockHolder lh(getMutex(i));
-            while (values[i]) {
-                StoredValue *v = values[i];
-                values[i] = v->next;
-                delete v;
+        for (int i = 0; i < (int)n_locks; i++) {
+            StripeLockHolder lh(lockAt(i));
+            for (size_t b = i; b < current.size; b += n_locks) {
+                clearBucket(current, b);
+            }
+            if (resizing) {
+                for (size_t b = i; b < old.size; b += n_locks) {
+                    clearBucket(old, b);
+                }
             }
-            depths[i] = 0;
         }
     }
 
     StoredValue *find(std::string &key) {
         assert(active);
-        int bucket_num = bucket(key);
-        LockHolder lh(getMutex(bucket_num));
-        return unlocked_find(key, bucket_num);
+        uint64_t hash = hashKey(key);
+        StripeLockHolder lh(getStripeLock(hash), true);
+        return unlocked_find(key, hash);
     }
 
     mutation_type_t set(const Item &val) {
         assert(active);
+        StripeLockHolder lh(getStripeLock(val.getHash()));
+        return unlocked_set(val);
+    }
+
+    /**
+     * Like set(), for a caller holding the item's stripe lock
+     * exclusively.  If the item was stored, *stored (when given) is
+     * set to the value holding it.
+     */
+    mutation_type_t unlocked_set(const Item &val, StoredValue **stored = NULL) {
         mutation_type_t rv = NOT_FOUND;
-        int bucket_num = bucket(val.getKey());
-        LockHolder lh(getMutex(bucket_num));
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num);
+        StoredValue *v = unlocked_find(val.getKey(), val.getHash());
         Item &itm = const_cast<Item&>(val);
         if (v) {
 
@@ -247,120 +654,569 @@ public:
             }
             itm.setCas();
             rv = v->isClean() ? WAS_CLEAN : WAS_DIRTY;
+            if (!v->isResident()) {
+                numNonResident.decr();
+            }
+            unaccount(v);
             v->setValue(itm.getValue(),
                         itm.getFlags(), itm.getExptime(),
                         itm.getCas());
+            account(v);
         } else {
             if (itm.getCas() != 0) {
                 return INVALID_CAS;
             }
             itm.setCas();
-            v = new StoredValue(itm, values[bucket_num]);
-            values[bucket_num] = v;
-            depths[bucket_num]++;
+            v = StoredValue::create(itm, NULL);
+            unlocked_insert(v);
+        }
+        if (stored) {
+            *stored = v;
         }
         return rv;
     }
 
     bool add(const Item &val, bool isDirty = true) {
         assert(active);
-        int bucket_num = bucket(val.getKey());
-        LockHolder lh(getMutex(bucket_num));
-        StoredValue *v = unlocked_find(val.getKey(), bucket_num);
+        uint64_t hash = val.getHash();
+        StripeLockHolder lh(getStripeLock(hash));
+        StoredValue *v = unlocked_find(val.getKey(), hash);
         if (v) {
             return false;
         } else {
             Item &itm = const_cast<Item&>(val);
             itm.setCas();
-            v = new StoredValue(itm, values[bucket_num], isDirty);
-            values[bucket_num] = v;
-            depths[bucket_num]++;
+            v = StoredValue::create(itm, NULL, isDirty);
+            unlocked_insert(v);
         }
 
         return true;
     }
 
-    StoredValue *unlocked_find(const std::string &key, int bucket_num) {
-        StoredValue *v = values[bucket_num];
-        while (v) {
-            if (key.compare(v->key) == 0) {
-                return v;
+    /**
+     * Add a batch of values built with StoredValue::create() from the
+     * persistent store's rows, as warmup does.  CAS values for the
+     * batch are taken at once, and each lock stripe is locked once for
+     * all of its values.  Values whose key is already present, or
+     * that the filter (if given) turns down, are destroyed.  The batch
+     * is left empty.
+     *
+     * @return the number of values added
+     */
+    size_t addBatch(std::vector<StoredValue*> &batch,
+                    HashTableLoadFilter *filter = NULL) {
+        assert(active);
+        std::sort(batch.begin(), batch.end(), StripeOrder(n_locks));
+        uint64_t cas = Item::nextCasRange(batch.size());
+        size_t added = 0;
+        std::vector<StoredValue*>::iterator it = batch.begin();
+        while (it != batch.end()) {
+            size_t stripe = (*it)->getHash() % n_locks;
+            StripeLockHolder lh(lockAt(stripe));
+            for (; it != batch.end()
+                     && (*it)->getHash() % n_locks == stripe; ++it) {
+                StoredValue *v = *it;
+                if (filter && !filter->shouldAdd(v)) {
+                    StoredValue::destroy(v);
+                } else if (unlocked_addLoaded(v, cas++)) {
+                    ++added;
+                }
             }
-            v = v->next;
         }
-        return NULL;
+        batch.clear();
+        return added;
     }
 
-    inline int bucket(const std::string &key) {
-        assert(active);
-        int h=5381;
-        int i=0;
-        const char *str = key.c_str();
-
-        for(i=0; str[i] != 0x00; i++) {
-            h = ((h << 5) + h) ^ str[i];
+    /**
+     * Like addBatch(), for one value and a caller holding its stripe
+     * lock exclusively.
+     *
+     * @return true if the value was added
+     */
+    bool unlocked_addLoaded(StoredValue *v, uint64_t cas) {
+        if (unlocked_find(v->getKeyBytes(), v->getKeyLen(), v->getHash())) {
+            StoredValue::destroy(v);
+            return false;
         }
+        v->cas = cas;
+        unlocked_insert(v);
+        return true;
+    }
 
-        return abs(h) % (int)size;
+    StoredValue *unlocked_find(const std::string &key, uint64_t hash) {
+        return unlocked_find(key.data(), key.size(), hash);
     }
 
-    // Get the mutex for a bucket (for doing your own lock management)
-    inline Mutex &getMutex(int bucket_num) {
+    StoredValue *unlocked_find(const char *key, size_t nkey, uint64_t hash) {
+        Table &t = tableFor(hash);
+        size_t b = hash % t.size;
+        if (layout == HT_TAGGED) {
+            uint8_t tag = tagFor(hash);
+            for (HashSlotGroup *g = &t.groups[b]; g; g = g->next) {
+                for (int i = 0; i < g->used; ++i) {
+                    if (g->tags[i] == tag && g->slots[i]->hasKey(key, nkey)) {
+                        return g->slots[i];
+                    }
+                }
+            }
+        } else {
+            StoredValue *v = t.chains[b];
+            while (v) {
+                if (v->hasKey(key, nkey)) {
+                    return v;
+                }
+                v = v->next;
+            }
+        }
+        return NULL;
+    }
+
+    // Get the lock for a key's hash (for doing your own lock management)
+    inline HashStripeLock &getStripeLock(uint64_t hash) {
         assert(active);
-        assert(bucket_num < (int)size);
-        assert(bucket_num >= 0);
-        int lock_num = bucket_num % (int)n_locks;
-        assert(lock_num < (int)n_locks);
-        assert(lock_num >= 0);
-        return mutexes[lock_num];
+        return lockAt(hash % n_locks);
     }
 
     // True if it existed
     bool del(const std::string &key) {
         assert(active);
-        int bucket_num = bucket(key);
-        LockHolder lh(getMutex(bucket_num));
+        uint64_t hash = hashKey(key);
+        StripeLockHolder lh(getStripeLock(hash));
+        return unlocked_del(key, hash);
+    }
+
+    // Like del(), for a caller holding the key's stripe lock exclusively.
+    bool unlocked_del(const std::string &key, uint64_t hash) {
+        StoredValue *v = unlocked_find(key, hash);
+        if (!v || v->isLocked(ep_current_time())) {
+            return false;
+        }
+
+        Table &t = tableFor(hash);
+        unlinkValue(t, hash % t.size, v);
+        forgetValue(v);
+        release(v);
+        return true;
+    }
+
+    /**
+     * Mark a value as queued for persistence or not, keeping count of
+     * the bytes queued values hold.  Caller must hold the value's
+     * stripe lock exclusively.
+     */
+    void unlocked_setQueued(StoredValue *v, bool queued) {
+        if (queued && !v->isQueued()) {
+            dirtySize.incr(v->kvSize());
+        } else if (!queued && v->isQueued()) {
+            dirtySize.decr(v->kvSize());
+        }
+        v->setQueued(queued);
+    }
+
+    /**
+     * Drop the value of a clean, resident StoredValue from memory,
+     * keeping its key and metadata.  Values still queued for
+     * persistence are kept: their write may not be committed yet.
+     * Caller must hold the value's stripe lock exclusively.
+     *
+     * @return true if the value was ejected
+     */
+    bool unlocked_ejectValue(StoredValue *v) {
+        if (!v->isResident() || v->isDirty() || v->isQueued()) {
+            return false;
+        }
+        unaccount(v);
+        v->value.reset();
+        account(v);
+        numNonResident.incr();
+        return true;
+    }
+
+    /**
+     * Put the value of an ejected StoredValue back in memory.  Caller
+     * must hold the value's stripe lock exclusively.
+     */
+    void unlocked_restoreValue(StoredValue *v, value_t val) {
+        assert(!v->isResident());
+        unaccount(v);
+        v->value = val;
+        account(v);
+        numNonResident.decr();
+    }
+
+    void visit(HashTableVisitor &visitor) {
+        for (size_t i = 0; i < n_locks && visitor.shouldContinue(); i++) {
+            visitStripe(i, visitor);
+        }
+    }
+
+    /**
+     * Visit the items guarded by one lock stripe, holding the stripe
+     * exclusively.  The visitor must not add or remove items.
+     */
+    void visitStripe(size_t i, HashTableVisitor &visitor) {
+        assert(i < n_locks);
+        StripeLockHolder lh(lockAt(i));
+        for (size_t b = i; b < current.size; b += n_locks) {
+            visitBucket(current, b, visitor);
+        }
+        if (resizing) {
+            for (size_t b = i; b < old.size; b += n_locks) {
+                visitBucket(old, b, visitor);
+            }
+        }
+    }
+
+    /**
+     * Visit the depth of every bucket.  While a resize is in
+     * progress, the old buckets that still hold items are reported
+     * after the new ones (numbered from getSize() onwards).
+     */
+    void visitDepth(HashTableDepthVisitor &visitor) {
+        for (int i = 0; i < (int)n_locks; i++) {
+            StripeLockHolder lh(lockAt(i), true);
+            for (size_t b = i; b < current.size; b += n_locks) {
+                visitor.visit(static_cast<int>(b), current.depths[b]);
+            }
+            if (resizing) {
+                size_t first = i + migrated[i] * n_locks;
+                for (size_t b = first; b < old.size; b += n_locks) {
+                    visitor.visit(static_cast<int>(current.size + b),
+                                  old.depths[b]);
+                }
+            }
+        }
+    }
+
+    /**
+     * Start resizing the table to (about) the given number of buckets.
+     *
+     * This only allocates the new bucket array; the items are moved
+     * over by resizeStep() and by mutations hitting buckets that have
+     * not been migrated yet.
+     *
+     * @return false if a resize is already running or not needed
+     */
+    bool resize(size_t to) {
+        assert(active);
+        to = roundSize(to);
+        if (resizing || to == current.size) {
+            return false;
+        }
 
-        StoredValue *v = values[bucket_num];
+        Table newTable;
+        allocTable(newTable, to);
 
-        // Special case empty bucket.
-        if (!v) {
+        lockAll();
+        if (resizing) {
+            unlockAll();
+            freeTable(newTable);
             return false;
         }
+        old = current;
+        current = newTable;
+        std::fill_n(migrated, n_locks, static_cast<size_t>(0));
+        resizeCursor = 0;
+        resizeBucketsDone.set(0);
+        resizeBucketsTotal.set(old.size);
+        resizing = true;
+        numResizes++;
+        unlockAll();
+        return true;
+    }
 
-        // Special case the first one
-        if (key.compare(v->key) == 0) {
-            if (v->isLocked(ep_current_time())) {
+    /**
+     * Migrate up to the given number of old buckets into the new
+     * table, holding one lock stripe at a time.  Completes the resize
+     * once every bucket has been moved.  Only one thread should drive
+     * a resize through this method at a time.
+     *
+     * @return true if the resize is still in progress
+     */
+    bool resizeStep(size_t nbuckets) {
+        assert(active);
+        if (!resizing) {
+            return false;
+        }
+        size_t moved = 0;
+        while (moved < nbuckets) {
+            size_t stripe = resizeCursor;
+            if (stripe >= n_locks) {
+                break;
+            }
+            StripeLockHolder lh(lockAt(stripe));
+            if (!resizing) {
                 return false;
             }
-            values[bucket_num] = v->next;
-            depths[bucket_num]--;
-            delete v;
-            return true;
+            size_t n = unlocked_migrateStripe(stripe, nbuckets - moved);
+            moved += n;
+            if (n == 0) {
+                ++resizeCursor;
+            }
         }
 
-        while (v->next) {
-            if (key.compare(v->next->key) == 0) {
-                StoredValue *tmp = v->next;
-                if (tmp->isLocked(ep_current_time())) {
-                    return false;
-                }
-                v->next = v->next->next;
-                delete tmp;
-                depths[bucket_num]--;
-                return true;
-            } else {
-                v = v->next;
+        if (resizeCursor >= n_locks) {
+            completeResize();
+            return false;
+        }
+        return true;
+    }
+
+    /**
+     * Get the number of buckets this table would like to have given
+     * the number of items it currently holds.
+     */
+    size_t getTargetSize() const {
+        size_t items = numItems.get();
+        size_t maxLoad = getMaxLoad();
+        if (items > current.size * maxLoad) {
+            return roundSize(items / (maxLoad / 2));
+        } else if (current.size > minSize
+                   && items < current.size * maxLoad / HT_SHRINK_LOAD) {
+            return roundSize(std::max(minSize, items / (maxLoad / 2)));
+        }
+        return current.size;
+    }
+
+    size_t getSize() const {
+        return current.size;
+    }
+
+    size_t getNumItems() const {
+        return numItems.get();
+    }
+
+    // Number of items whose value has been ejected from memory.
+    size_t getNumNonResident() const {
+        return numNonResident.get();
+    }
+
+    // Approximate bytes of memory held by the stored items.
+    size_t getMemSize() const {
+        return memSize.get();
+    }
+
+    // Bytes of key and value data held by the stored items.
+    size_t getKVSize() const {
+        return kvSize.get();
+    }
+
+    // Bytes of key and value data held by items queued for persistence.
+    size_t getDirtySize() const {
+        return dirtySize.get();
+    }
+
+    // Bytes held by the stored items on top of their keys and values.
+    size_t getOverhead() const {
+        size_t mem = memSize.get();
+        size_t kv = kvSize.get();
+        return mem > kv ? mem - kv : 0;
+    }
+
+    hash_table_layout_t getLayout() const {
+        return layout;
+    }
+
+    hash_table_lock_t getLockType() const {
+        return lockType;
+    }
+
+    size_t getNumLocks() const {
+        return n_locks;
+    }
+
+    // Get the lock of the given stripe (for lock statistics).
+    const HashStripeLock &getStripe(size_t i) const {
+        assert(i < n_locks);
+        return const_cast<HashTable*>(this)->lockAt(i);
+    }
+
+    bool isResizing() const {
+        return resizing;
+    }
+
+    size_t getNumResizes() const {
+        return numResizes.get();
+    }
+
+    // Number of old buckets migrated by the running resize.
+    size_t getResizeBucketsDone() const {
+        return resizeBucketsDone.get();
+    }
+
+    // Number of old buckets to migrate by the running resize.
+    size_t getResizeBucketsTotal() const {
+        return resizeBucketsTotal.get();
+    }
+
+private:
+
+    // A bucket array in the configured layout.
+    struct Table {
+        StoredValue   **chains;
+        HashSlotGroup  *groups;
+        int            *depths;
+        size_t          size;
+    };
+
+    // Orders values by the lock stripe they belong to.
+    class StripeOrder {
+    public:
+        StripeOrder(size_t n) : n_locks(n) { }
+        bool operator()(const StoredValue *a, const StoredValue *b) const {
+            return a->getHash() % n_locks < b->getHash() % n_locks;
+        }
+    private:
+        size_t n_locks;
+    };
+
+    // Grow once the average bucket holds more than this many items.
+    static const size_t HT_MAX_LOAD_CHAINED = 2;
+    static const size_t HT_MAX_LOAD_TAGGED = 4;
+    // Shrink once the average bucket holds less than 1/HT_SHRINK_LOAD
+    // of the maximum load.
+    static const size_t HT_SHRINK_LOAD = 16;
+    // Buckets migrated by each insert that hits a resizing stripe.
+    static const size_t HT_MIGRATE_PER_OP = 2;
+
+    size_t getMaxLoad() const {
+        return layout == HT_TAGGED ? HT_MAX_LOAD_TAGGED : HT_MAX_LOAD_CHAINED;
+    }
+
+    /**
+     * Round the number of buckets up to an odd multiple of the number
+     * of locks so every bucket belongs to exactly one stripe in both
+     * the old and the new table.
+     */
+    size_t roundSize(size_t s) const {
+        size_t perLock = std::max(static_cast<size_t>(1),
+                                  (s + n_locks - 1) / n_locks);
+        perLock |= 1;
+        return perLock * n_locks;
+    }
+
+    // The hash's low bits pick the bucket, so tag on the high ones.
+    static inline uint8_t tagFor(uint64_t hash) {
+        return static_cast<uint8_t>(hash >> 56);
+    }
+
+    void allocTable(Table &t, size_t s) {
+        t.size = s;
+        t.chains = NULL;
+        t.groups = NULL;
+        t.depths = NULL;
+        if (s == 0) {
+            return;
+        }
+        t.depths = new int[s];
+        std::fill_n(t.depths, s, 0);
+        if (layout == HT_TAGGED) {
+            t.groups = new HashSlotGroup[s];
+        } else {
+            t.chains = new StoredValue*[s];
+            std::fill_n(t.chains, s, static_cast<StoredValue*>(NULL));
+        }
+    }
+
+    // Release a table's bucket array; its buckets must be empty.
+    void freeTable(Table &t) {
+        delete []t.chains;
+        delete []t.groups;
+        delete []t.depths;
+        allocTable(t, 0);
+    }
+
+    // True if the bucket's items still live in the old table.
+    // Caller must hold the bucket's lock.
+    inline bool inOldTable(uint64_t hash) const {
+        if (!resizing) {
+            return false;
+        }
+        size_t ob = hash % old.size;
+        return ob / n_locks >= migrated[ob % n_locks];
+    }
+
+    inline Table &tableFor(uint64_t hash) {
+        return inOldTable(hash) ? old : current;
+    }
+
+    // Link a new value in where lookups will find it.  Caller must
+    // hold the bucket's lock.
+    void unlocked_insert(StoredValue *v) {
+        Table &t = tableFor(v->hash);
+        linkValue(t, v->hash % t.size, v, tagFor(v->hash));
+        ++numItems;
+        account(v);
+        if (!v->isResident()) {
+            numNonResident.incr();
+        }
+        if (resizing) {
+            unlocked_migrateStripe(v->hash % n_locks, HT_MIGRATE_PER_OP);
+        }
+    }
+
+    void linkValue(Table &t, size_t b, StoredValue *v, uint8_t tag) {
+        if (layout == HT_TAGGED) {
+            HashSlotGroup *g = &t.groups[b];
+            while (g->used == HashSlotGroup::NSLOTS && g->next) {
+                g = g->next;
+            }
+            if (g->used == HashSlotGroup::NSLOTS) {
+                g->next = new HashSlotGroup;
+                g = g->next;
             }
+            g->tags[g->used] = tag;
+            g->slots[g->used] = v;
+            ++g->used;
+        } else {
+            v->next = t.chains[b];
+            t.chains[b] = v;
         }
+        ++t.depths[b];
+    }
 
-        return false;
+    void unlinkValue(Table &t, size_t b, StoredValue *v) {
+        if (layout == HT_TAGGED) {
+            HashSlotGroup *prev = NULL;
+            for (HashSlotGroup *g = &t.groups[b]; g; prev = g, g = g->next) {
+                for (int i = 0; i < g->used; ++i) {
+                    if (g->slots[i] != v) {
+                        continue;
+                    }
+                    --g->used;
+                    g->tags[i] = g->tags[g->used];
+                    g->slots[i] = g->slots[g->used];
+                    if (g->used == 0 && prev != NULL) {
+                        prev->next = g->next;
+                        delete g;
+                    }
+                    --t.depths[b];
+                    return;
+                }
+            }
+        } else {
+            StoredValue **pp = &t.chains[b];
+            while (*pp) {
+                if (*pp == v) {
+                    *pp = v->next;
+                    --t.depths[b];
+                    return;
+                }
+                pp = &(*pp)->next;
+            }
+        }
+        assert(false);
     }
 
-    void visit(HashTableVisitor &visitor) {
-        for (int i = 0; i < (int)size; i++) {
-            LockHolder lh(getMutex(i));
-            StoredValue *v = values[i];
+    void visitBucket(Table &t, size_t b, HashTableVisitor &visitor) {
+        if (layout == HT_TAGGED) {
+            for (HashSlotGroup *g = &t.groups[b]; g; g = g->next) {
+                for (int i = 0; i < g->used; ++i) {
+                    visitor.visit(g->slots[i]);
+                }
+            }
+        } else {
+            StoredValue *v = t.chains[b];
             while (v) {
                 visitor.visit(v);
                 v = v->next;
@@ -368,20 +1224,189 @@ public:
         }
     }
 
-    void visitDepth(HashTableDepthVisitor &visitor) {
-        for (int i = 0; i < (int)size; i++) {
-            LockHolder lh(getMutex(i));
-            visitor.visit(i, depths[i]);
+    /**
+     * Detach every value from a bucket, leaving it empty, and return
+     * them as a list linked through StoredValue::next.
+     */
+    StoredValue *drainBucket(Table &t, size_t b) {
+        StoredValue *rv = NULL;
+        if (layout == HT_TAGGED) {
+            HashSlotGroup *first = &t.groups[b];
+            HashSlotGroup *g = first;
+            while (g) {
+                for (int i = 0; i < g->used; ++i) {
+                    g->slots[i]->next = rv;
+                    rv = g->slots[i];
+                }
+                HashSlotGroup *next = g->next;
+                if (g != first) {
+                    delete g;
+                }
+                g = next;
+            }
+            first->used = 0;
+            first->next = NULL;
+        } else {
+            rv = t.chains[b];
+            t.chains[b] = NULL;
         }
+        t.depths[b] = 0;
+        return rv;
     }
 
-private:
-    size_t        size;
-    size_t        n_locks;
-    bool          active;
-    StoredValue **values;
-    Mutex        *mutexes;
-    int          *depths;
+    void clearBucket(Table &t, size_t b) {
+        StoredValue *v = drainBucket(t, b);
+        while (v) {
+            StoredValue *next = v->next;
+            forgetValue(v);
+            release(v);
+            v = next;
+        }
+    }
+
+    /**
+     * Move up to n old buckets belonging to the given stripe into the
+     * new table.  Caller must hold the stripe's lock.
+     *
+     * @return the number of buckets moved
+     */
+    size_t unlocked_migrateStripe(size_t stripe, size_t n) {
+        size_t perStripe = old.size / n_locks;
+        size_t moved = 0;
+        while (moved < n && migrated[stripe] < perStripe) {
+            size_t ob = stripe + migrated[stripe] * n_locks;
+            StoredValue *v = drainBucket(old, ob);
+            while (v) {
+                StoredValue *next = v->next;
+                linkValue(current, v->hash % current.size, v,
+                          tagFor(v->hash));
+                v = next;
+            }
+            ++migrated[stripe];
+            ++moved;
+        }
+        resizeBucketsDone.incr(moved);
+        return moved;
+    }
+
+    void completeResize() {
+        lockAll();
+        if (resizing) {
+            for (size_t i = 0; i < n_locks; ++i) {
+                assert(migrated[i] == old.size / n_locks);
+            }
+            freeTable(old);
+            resizing = false;
+            resizeBucketsTotal.set(0);
+            resizeBucketsDone.set(0);
+        }
+        unlockAll();
+    }
+
+    /**
+     * Allocate the stripe locks, each on its own cache line(s) so
+     * stripes taken by different threads don't false-share.
+     */
+    void allocStripes(hash_table_lock_t lt) {
+        stripeStride = ((sizeof(HashStripeLock) + CACHE_LINE_SIZE - 1)
+                        / CACHE_LINE_SIZE) * CACHE_LINE_SIZE;
+        void *mem = NULL;
+        if (posix_memalign(&mem, CACHE_LINE_SIZE,
+                           stripeStride * n_locks) != 0) {
+            throw std::bad_alloc();
+        }
+        stripeMem = static_cast<char*>(mem);
+        for (size_t i = 0; i < n_locks; ++i) {
+            new (stripeMem + i * stripeStride) HashStripeLock();
+            lockAt(i).setType(lt);
+        }
+    }
+
+    void freeStripes() {
+        for (size_t i = 0; i < n_locks; ++i) {
+            lockAt(i).~HashStripeLock();
+        }
+        free(stripeMem);
+    }
+
+    inline HashStripeLock &lockAt(size_t i) {
+        return *reinterpret_cast<HashStripeLock*>(stripeMem + i * stripeStride);
+    }
+
+    // Take an unlinked value out of the table's counters.
+    void forgetValue(StoredValue *v) {
+        numItems.decr();
+        unaccount(v);
+        if (!v->isResident()) {
+            numNonResident.decr();
+        }
+    }
+
+    // Dispose of an unlinked value, unless the persistence queue
+    // still refers to it.
+    void release(StoredValue *v) {
+        if (v->isQueued()) {
+            v->bits |= StoredValue::DELETED;
+        } else {
+            StoredValue::destroy(v);
+        }
+    }
+
+    // Add a value's memory to the table's counters.
+    void account(const StoredValue *v) {
+        memSize.incr(v->size());
+        kvSize.incr(v->kvSize());
+        if (v->isQueued()) {
+            dirtySize.incr(v->kvSize());
+        }
+    }
+
+    // Take a value's memory back out of the table's counters.
+    void unaccount(const StoredValue *v) {
+        memSize.decr(v->size());
+        kvSize.decr(v->kvSize());
+        if (v->isQueued()) {
+            dirtySize.decr(v->kvSize());
+        }
+    }
+
+    void lockAll() {
+        for (size_t i = 0; i < n_locks; ++i) {
+            lockAt(i).acquire();
+        }
+    }
+
+    void unlockAll() {
+        for (size_t i = n_locks; i > 0; --i) {
+            lockAt(i - 1).release();
+        }
+    }
+
+    Table               current;
+    size_t              minSize;
+    size_t              n_locks;
+    hash_table_layout_t layout;
+    hash_table_lock_t   lockType;
+    bool                active;
+    char               *stripeMem;
+    size_t              stripeStride;
+
+    // State of a running resize; only changed with all locks held.
+    volatile bool resizing;
+    Table         old;
+    // Number of old buckets migrated, per lock stripe.
+    size_t       *migrated;
+    // Next stripe for resizeStep() to work on.
+    volatile size_t resizeCursor;
+
+    Atomic<size_t> numItems;
+    Atomic<size_t> numNonResident;
+    Atomic<size_t> memSize;
+    Atomic<size_t> kvSize;
+    Atomic<size_t> dirtySize;
+    Atomic<size_t> numResizes;
+    Atomic<size_t> resizeBucketsDone;
+    Atomic<size_t> resizeBucketsTotal;
 
     DISALLOW_COPY_AND_ASSIGN(HashTable);
 };
@@ -0,0 +1,321 @@
+#include <assert.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "atomic.hh"
+#include "dispatcher.hh"
+
+static void quietLog(EXTENSION_LOG_LEVEL, const void *, const char *, ...) {
+}
+
+static EXTENSION_LOGGER_DESCRIPTOR quietLogger = { NULL, quietLog };
+
+EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
+    return &quietLogger;
+}
+
+// Tasks running right now, and the most that ever ran at once.
+static Atomic<int> runningNow;
+static Atomic<int> mostRunning;
+
+// Wait up to a few seconds for a counter to reach n.
+static bool waitFor(Atomic<int> &counter, int n) {
+    for (int i = 0; i < 500 && counter.get() < n; ++i) {
+        usleep(10000);
+    }
+    return counter.get() >= n;
+}
+
+/**
+ * Records the order tasks ran in, and runs each a given number of
+ * times, snoozing in between.
+ */
+class Recorder : public DispatcherCallback {
+public:
+    Recorder(int i, std::vector<int> &o, SyncObject &m, int r=1,
+             double s=0) :
+        id(i), order(o), mutex(m), runs(r), snooze(s) { }
+
+    bool callback(Dispatcher &d, TaskId t) {
+        LockHolder lh(mutex);
+        order.push_back(id);
+        mutex.notify();
+        if (--runs > 0) {
+            d.snooze(t, snooze);
+            return true;
+        }
+        return false;
+    }
+
+private:
+    int               id;
+    std::vector<int> &order;
+    SyncObject       &mutex;
+    int               runs;
+    double            snooze;
+};
+
+/**
+ * Runs until released, keeping count of how many tasks like it are
+ * running at once.
+ */
+class Blocker : public DispatcherCallback {
+public:
+    Blocker(Atomic<int> &s, Atomic<int> &f, Atomic<bool> &r) :
+        started(s), finished(f), release(r) { }
+
+    bool callback(Dispatcher &, TaskId) {
+        int n = ++runningNow;
+        int most = mostRunning.get();
+        while (n > most && !mostRunning.cas(most, n)) {
+            most = mostRunning.get();
+        }
+        started++;
+        while (!release.get()) {
+            usleep(1000);
+        }
+        runningNow.decr();
+        finished++;
+        return false;
+    }
+
+private:
+    Atomic<int>  &started;
+    Atomic<int>  &finished;
+    Atomic<bool> &release;
+};
+
+// Counts its runs.
+class Counter : public DispatcherCallback {
+public:
+    Counter(Atomic<int> &r) : ran(r) { }
+
+    bool callback(Dispatcher &, TaskId) {
+        ran++;
+        return false;
+    }
+
+private:
+    Atomic<int> &ran;
+};
+
+// Runs again straight away until stopped.
+class Spinner : public DispatcherCallback {
+public:
+    Spinner(Atomic<int> &r, Atomic<bool> &s) : ran(r), stop(s) { }
+
+    bool callback(Dispatcher &, TaskId) {
+        ran++;
+        return !stop.get();
+    }
+
+private:
+    Atomic<int>  &ran;
+    Atomic<bool> &stop;
+};
+
+static void resetRunning() {
+    runningNow.set(0);
+    mostRunning.set(0);
+}
+
+static void testPriority() {
+    std::vector<int> order;
+    SyncObject mutex;
+    Dispatcher d;
+    // Queued before the worker starts, so they run by priority alone,
+    // whatever their class.
+    d.schedule(shared_ptr<Recorder>(new Recorder(2, order, mutex)), 2);
+    d.schedule(shared_ptr<Recorder>(new Recorder(0, order, mutex)), 0);
+    d.schedule(shared_ptr<Recorder>(new Recorder(1, order, mutex)), 1,
+               0, task_class_write);
+    d.start();
+    LockHolder lh(mutex);
+    while (order.size() < 3) {
+        mutex.wait();
+    }
+    lh.unlock();
+    d.stop();
+    assert(order[0] == 0 && order[1] == 1 && order[2] == 2);
+}
+
+static void testSnooze() {
+    std::vector<int> order;
+    SyncObject mutex;
+    Dispatcher d(3);
+    d.start();
+    d.schedule(shared_ptr<Recorder>(new Recorder(0, order, mutex, 3, 0.2)));
+    d.schedule(shared_ptr<Recorder>(new Recorder(1, order, mutex, 1)),
+               0, 0.1);
+    LockHolder lh(mutex);
+    while (order.size() < 4) {
+        mutex.wait();
+    }
+    lh.unlock();
+    d.stop();
+    assert(order[0] == 0 && order[1] == 1 && order[2] == 0 && order[3] == 0);
+}
+
+static void testCancel() {
+    Atomic<int> ran(0);
+    Dispatcher d(2);
+    TaskId t = d.schedule(shared_ptr<Counter>(new Counter(ran)), 0, 0.1);
+    d.cancel(t);
+    // A cancelled task stays cancelled, even if it's snoozed.
+    d.snooze(t, 0.1);
+    d.start();
+    usleep(300000);
+    assert(ran.get() == 0);
+
+    // Waking a task runs a copy of it now.
+    t = d.schedule(shared_ptr<Counter>(new Counter(ran)), 0, 3600);
+    d.wake(t);
+    assert(waitFor(ran, 1));
+    d.stop();
+    assert(ran.get() == 1);
+}
+
+static void testSerial() {
+    Atomic<int> started(0), finished(0);
+    Atomic<bool> release(false);
+    resetRunning();
+    Dispatcher d(4);
+    d.start();
+    // Three tasks on the same connection, spread over the classes.
+    int connection;
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)),
+               0, 0, task_class_write, &connection);
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)),
+               0, 0, task_class_read, &connection);
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)),
+               0, 0, task_class_write, &connection);
+    assert(waitFor(started, 1));
+    usleep(100000);
+    assert(started.get() == 1);
+    release.set(true);
+    assert(waitFor(finished, 3));
+    d.stop();
+    assert(mostRunning.get() == 1);
+}
+
+static void testSerialTurns() {
+    Atomic<int> spins(0), ran(0);
+    Atomic<bool> stop(false);
+    Dispatcher d(3);
+    d.start();
+    // A task that never sleeps doesn't keep others off its serial.
+    int connection;
+    d.schedule(shared_ptr<Spinner>(new Spinner(spins, stop)),
+               0, 0, task_class_write, &connection);
+    assert(waitFor(spins, 100));
+    d.schedule(shared_ptr<Counter>(new Counter(ran)),
+               0, 0, task_class_read, &connection);
+    d.schedule(shared_ptr<Counter>(new Counter(ran)),
+               0, 0, task_class_write, &connection);
+    assert(waitFor(ran, 2));
+    stop.set(true);
+    d.stop();
+}
+
+static void testClasses() {
+    Atomic<int> started(0), finished(0), ran(0);
+    Atomic<bool> release(false);
+    resetRunning();
+    // A write worker and a non-IO one.
+    Dispatcher d(2);
+    d.start();
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)),
+               0, 0, task_class_write);
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)),
+               0, 0, task_class_write);
+    assert(waitFor(started, 1));
+
+    // A long write doesn't hold up a non-IO task...
+    d.schedule(shared_ptr<Counter>(new Counter(ran)));
+    assert(waitFor(ran, 1));
+
+    // ...but the non-IO worker never takes the other write.
+    usleep(100000);
+    assert(started.get() == 1);
+    release.set(true);
+    assert(waitFor(finished, 2));
+    d.stop();
+    assert(mostRunning.get() == 1);
+}
+
+static void testLighterClasses() {
+    Atomic<int> started(0), finished(0);
+    Atomic<bool> release(false);
+    resetRunning();
+    // The write worker takes lighter tasks when it has none of its own.
+    Dispatcher d(2);
+    d.start();
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)));
+    d.schedule(shared_ptr<Blocker>(new Blocker(started, finished, release)));
+    assert(waitFor(started, 2));
+    assert(mostRunning.get() == 2);
+    release.set(true);
+    assert(waitFor(finished, 2));
+    d.stop();
+}
+
+static void testOrdering() {
+    Atomic<int> ran(0);
+    Dispatcher d;
+    // Tasks of each state, for the queues' order to be consistent
+    // across, or runnable tasks could end up behind sleeping ones.
+    std::vector<TaskId> tasks;
+    tasks.push_back(d.schedule(shared_ptr<Counter>(new Counter(ran)), 0));
+    tasks.push_back(d.schedule(shared_ptr<Counter>(new Counter(ran)), 1));
+    tasks.push_back(d.schedule(shared_ptr<Counter>(new Counter(ran)), 0, 10));
+    tasks.push_back(d.schedule(shared_ptr<Counter>(new Counter(ran)), 0, 20));
+    tasks.push_back(d.schedule(shared_ptr<Counter>(new Counter(ran)), 1));
+    d.cancel(tasks.back());
+    CompareTasks lower;
+    for (size_t a = 0; a < tasks.size(); ++a) {
+        assert(!lower(tasks[a], tasks[a]));
+        for (size_t b = 0; b < tasks.size(); ++b) {
+            assert(!(lower(tasks[a], tasks[b]) && lower(tasks[b], tasks[a])));
+            for (size_t c = 0; c < tasks.size(); ++c) {
+                assert(!lower(tasks[a], tasks[b]) || !lower(tasks[b], tasks[c])
+                       || lower(tasks[a], tasks[c]));
+            }
+        }
+    }
+    assert(lower(tasks[2], tasks[0]) && lower(tasks[3], tasks[2]));
+    assert(lower(tasks[1], tasks[0]));
+}
+
+static void testWakeAmongSleepers() {
+    Atomic<int> ran(0), slept(0);
+    Dispatcher d;
+    // The task woken here is queued under the one it replaces, which
+    // had been asleep under the first.  It mustn't have to wait for
+    // that one to be due.
+    d.schedule(shared_ptr<Counter>(new Counter(slept)), 0, 10);
+    TaskId t = d.schedule(shared_ptr<Counter>(new Counter(ran)), 0, 3600);
+    d.schedule(shared_ptr<Counter>(new Counter(slept)), 0, 3600);
+    d.wake(t);
+    d.start();
+    assert(waitFor(ran, 1));
+    d.stop();
+    assert(slept.get() == 0);
+}
+
+int main() {
+    assert(Dispatcher::workerClass(0) == task_class_write);
+    assert(Dispatcher::workerClass(1) == task_class_nonio);
+    assert(Dispatcher::workerClass(2) == task_class_read);
+    assert(Dispatcher::workerClass(3) == task_class_write);
+    testPriority();
+    testSnooze();
+    testCancel();
+    testSerial();
+    testSerialTurns();
+    testClasses();
+    testLighterClasses();
+    testOrdering();
+    testWakeAmongSleepers();
+    return 0;
+}
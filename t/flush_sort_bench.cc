@@ -0,0 +1,181 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare flushing with and without key-sorted transactions.
+ *
+ * Usage: flush_sort_bench [rows [writes [dbname]]]
+ *
+ * Fills a sharded database (default /tmp/flush_sort_bench.db) with
+ * rows rows (default 10M), then alternately flushes writes (default
+ * 1M) random updates and inserts in the order they were queued and
+ * sorted by key, reporting items per second and the commit times seen
+ * for each.  Any existing database of that name is replaced.
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ep.hh>
+#include <flusher.hh>
+#include <item.hh>
+#include <sqlite-kvstore.hh>
+#include <sqlite-strategies.hh>
+
+#define NUM_SHARDS 4
+#define ROUNDS 2
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return static_cast<rel_time_t>(time(NULL));
+    }
+}
+
+static void quietLog(EXTENSION_LOG_LEVEL, const void *, const char *, ...) {
+}
+
+static EXTENSION_LOGGER_DESCRIPTOR quietLogger = { NULL, quietLog };
+
+EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
+    return &quietLogger;
+}
+
+class IgnoreCallback : public Callback<bool> {
+public:
+    void callback(bool &) { }
+};
+
+// Counts items whose write hasn't been committed yet.
+class QueuedVisitor : public HashTableVisitor {
+public:
+    QueuedVisitor() : queued(0) { }
+    void visit(StoredValue *v) {
+        if (v->isQueued()) {
+            ++queued;
+        }
+    }
+    size_t queued;
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::string makeKey(size_t i) {
+    char buf[32];
+    snprintf(buf, sizeof(buf), "key:%010lu", static_cast<unsigned long>(i));
+    return std::string(buf);
+}
+
+// Fill the shards with keys 0..rows-1, each in key order.
+static void preload(std::vector<KVStore*> &shards, size_t rows,
+                    const std::string &value) {
+    IgnoreCallback cb;
+    double start = now();
+    for (size_t i = 0; i < rows; ++i) {
+        if (i % 100000 == 0) {
+            for (size_t s = 0; s < shards.size(); ++s) {
+                shards[s]->commit();
+                shards[s]->begin();
+            }
+        }
+        Item itm(makeKey(i), 0, 0, value.data(), value.length());
+        shards[itm.getHash() % shards.size()]->set(itm, cb);
+    }
+    for (size_t s = 0; s < shards.size(); ++s) {
+        shards[s]->commit();
+    }
+    printf("preloaded %lu rows in %.1fs\n",
+           static_cast<unsigned long>(rows), now() - start);
+}
+
+static void bench(KVStore *empty, std::vector<KVStore*> &shards,
+                  size_t rows, size_t writes, bool sorted, unsigned int seed,
+                  const std::string &value) {
+    EventuallyPersistentStore *store =
+        new EventuallyPersistentStore(empty, HT_CHAINED, HT_LOCK_MUTEX,
+                                      DEFAULT_HT_LOCKS, shards);
+    EPStats &stats = store->getStats();
+    store->setMinDataAge(0);
+    store->setSortFlushBatches(sorted);
+    while (!stats.warmupComplete.get()) {
+        usleep(1000);
+    }
+    store->pauseFlusher();
+
+    // A tenth of the writes are inserts past the preloaded rows.
+    IgnoreCallback cb;
+    for (size_t i = 0; i < writes; ++i) {
+        size_t k = static_cast<size_t>(rand_r(&seed)) % (rows + rows / 10);
+        Item itm(makeKey(k), 0, 0, value.data(), value.length());
+        store->set(itm, cb);
+    }
+
+    double start = now();
+    store->resumeFlusher();
+    size_t samples = 0, commitMs = 0, commitMsMax = 0;
+    for (;;) {
+        usleep(10000);
+        size_t c = stats.commitTimeMs.get();
+        commitMs += c;
+        commitMsMax = std::max(commitMsMax, c);
+        ++samples;
+        if (stats.queue_size.get() == 0 && stats.flusher_todo.get() == 0) {
+            QueuedVisitor qv;
+            store->visit(qv);
+            if (qv.queued == 0) {
+                break;
+            }
+        }
+    }
+    double elapsed = now() - start;
+
+    printf("%-8s %9.0f items/s  %7.2fs  commit_time_ms mean %lu max %lu\n",
+           sorted ? "sorted" : "queued", store->getHashTable().getNumItems()
+           / elapsed, elapsed,
+           static_cast<unsigned long>(commitMs / samples),
+           static_cast<unsigned long>(commitMsMax));
+    delete store;
+}
+
+int main(int argc, char **argv) {
+    size_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    size_t writes = argc > 2 ? strtoul(argv[2], NULL, 10) : 1000000;
+    std::string dbname = argc > 3 ? argv[3] : "/tmp/flush_sort_bench.db";
+    std::string value(100, 'v');
+    setvbuf(stdout, NULL, _IONBF, 0);
+    ep_current_time = basic_current_time;
+
+    remove(dbname.c_str());
+    MultiDBSqliteStrategy *strategy =
+        new MultiDBSqliteStrategy(dbname.c_str(), NULL, NUM_SHARDS);
+    for (int i = 0; i < NUM_SHARDS; ++i) {
+        remove(strategy->shardFile(i).c_str());
+    }
+    StrategicSqlite3 *all = new StrategicSqlite3(strategy);
+    std::vector<KVStore*> shards;
+    for (int i = 0; i < NUM_SHARDS; ++i) {
+        shards.push_back(new StrategicSqlite3(
+                             new SqliteStrategy(strategy->shardFile(i).c_str())));
+    }
+    preload(shards, rows, value);
+
+    // Warmup reads through the main connection; give it an empty
+    // database so the store doesn't load all the rows.
+    std::string emptyName = dbname + "-empty";
+    remove(emptyName.c_str());
+    StrategicSqlite3 *empty =
+        new StrategicSqlite3(new SqliteStrategy(emptyName.c_str()));
+
+    for (int r = 0; r < ROUNDS; ++r) {
+        bench(empty, shards, rows, writes, false, 2 * r + 1, value);
+        bench(empty, shards, rows, writes, true, 2 * r + 2, value);
+    }
+
+    delete empty;
+    for (int i = 0; i < NUM_SHARDS; ++i) {
+        delete shards[i];
+    }
+    delete all;
+    return 0;
+}
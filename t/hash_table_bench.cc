@@ -0,0 +1,116 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare the hash table bucket layouts.
+ *
+ * Usage: hash_table_bench [nkeys ...]
+ *
+ * For each key count (default 1M, 10M and 50M) and each layout this
+ * inserts that many keys, letting the table resize the way the
+ * engine's resizer task would, then times random lookups of keys that
+ * are present and of keys that are not.
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ep.hh>
+#include <item.hh>
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static std::string makeKey(const char *prefix, size_t i) {
+    char buf[64];
+    snprintf(buf, sizeof(buf), "%s%lu", prefix, static_cast<unsigned long>(i));
+    return std::string(buf);
+}
+
+// Visit keys in a scattered but repeatable order.
+static size_t scatter(size_t i, size_t n) {
+    return (i * 7919 + 13) % n;
+}
+
+static void keepResizing(HashTable &h) {
+    if (h.isResizing()) {
+        h.resizeStep(HT_RESIZE_STEP_SIZE);
+    } else if (h.getTargetSize() != h.getSize()) {
+        h.resize(h.getTargetSize());
+    }
+}
+
+static void bench(hash_table_layout_t layout, size_t nkeys) {
+    HashTable h(DEFAULT_HT_SIZE, DEFAULT_HT_LOCKS, layout);
+    const char *name = layout == HT_TAGGED ? "tagged" : "chained";
+
+    double start = now();
+    for (size_t i = 0; i < nkeys; ++i) {
+        std::string k = makeKey("key", i);
+        Item itm(k, 0, 0, "v", 1);
+        h.set(itm);
+        if (i % 65536 == 0) {
+            keepResizing(h);
+        }
+    }
+    while (h.isResizing() || h.getTargetSize() != h.getSize()) {
+        keepResizing(h);
+    }
+    double insertTime = now() - start;
+
+    start = now();
+    size_t found = 0;
+    for (size_t i = 0; i < nkeys; ++i) {
+        std::string k = makeKey("key", scatter(i, nkeys));
+        if (h.find(k)) {
+            ++found;
+        }
+    }
+    double hitTime = now() - start;
+    assert(found == nkeys);
+
+    start = now();
+    for (size_t i = 0; i < nkeys; ++i) {
+        std::string k = makeKey("miss", scatter(i, nkeys));
+        if (h.find(k)) {
+            ++found;
+        }
+    }
+    double missTime = now() - start;
+    assert(found == nkeys);
+
+    printf("%-8s %10lu keys %10lu buckets  insert %7.1f ns/op"
+           "  hit %7.1f ns/op  miss %7.1f ns/op\n",
+           name, static_cast<unsigned long>(nkeys),
+           static_cast<unsigned long>(h.getSize()),
+           insertTime * 1e9 / nkeys, hitTime * 1e9 / nkeys,
+           missTime * 1e9 / nkeys);
+}
+
+int main(int argc, char **argv) {
+    std::vector<size_t> sizes;
+    for (int i = 1; i < argc; ++i) {
+        sizes.push_back(strtoul(argv[i], NULL, 10));
+    }
+    if (sizes.empty()) {
+        sizes.push_back(1000000);
+        sizes.push_back(10000000);
+        sizes.push_back(50000000);
+    }
+
+    std::vector<size_t>::iterator it;
+    for (it = sizes.begin(); it != sizes.end(); ++it) {
+        bench(HT_CHAINED, *it);
+        bench(HT_TAGGED, *it);
+    }
+    return 0;
+}
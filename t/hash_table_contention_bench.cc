@@ -0,0 +1,125 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare the hash table stripe lock types under concurrent load.
+ *
+ * Usage: hash_table_contention_bench [threads [read% [nkeys [seconds]]]]
+ *
+ * Each thread picks random keys out of nkeys (default 1000, small
+ * enough that threads meet on the same stripes) and either looks one
+ * up the way EventuallyPersistentStore::get does or sets it, with
+ * read% (default 95) of the operations being lookups.  This runs for
+ * the given number of seconds (default 2) for each lock type and
+ * reports the total throughput.
+ */
+#include <sys/time.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ep.hh>
+#include <item.hh>
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+struct worker_args {
+    HashTable *h;
+    std::vector<std::string> *keys;
+    int readPct;
+    unsigned int seed;
+    volatile bool *running;
+    size_t ops;
+};
+
+extern "C" {
+    static void *worker(void *arg) {
+        struct worker_args *args = static_cast<struct worker_args*>(arg);
+        HashTable &h = *args->h;
+        std::vector<std::string> &keys = *args->keys;
+        size_t ops = 0;
+
+        while (*args->running) {
+            const std::string &k = keys[rand_r(&args->seed) % keys.size()];
+            if (static_cast<int>(rand_r(&args->seed) % 100) < args->readPct) {
+                uint64_t hash = hashKey(k);
+                StripeLockHolder lh(h.getStripeLock(hash), true);
+                StoredValue *v = h.unlocked_find(k, hash);
+                assert(v);
+                value_t val = v->getValue();
+            } else {
+                Item itm(k, 0, 0, "value", 5);
+                h.set(itm);
+            }
+            ++ops;
+        }
+        args->ops = ops;
+        return NULL;
+    }
+}
+
+static void bench(hash_table_lock_t lockType, int nthreads, int readPct,
+                  size_t nkeys, double seconds) {
+    HashTable h(DEFAULT_HT_SIZE, DEFAULT_HT_LOCKS, HT_CHAINED, lockType);
+    const char *name = lockType == HT_LOCK_RWLOCK ? "rwlock" : "mutex";
+
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < nkeys; ++i) {
+        char buf[32];
+        snprintf(buf, sizeof(buf), "key%lu", static_cast<unsigned long>(i));
+        keys.push_back(std::string(buf));
+        Item itm(keys.back(), 0, 0, "value", 5);
+        h.set(itm);
+    }
+
+    volatile bool running = true;
+    std::vector<pthread_t> threads(nthreads);
+    std::vector<struct worker_args> args(nthreads);
+    double start = now();
+    for (int i = 0; i < nthreads; ++i) {
+        args[i].h = &h;
+        args[i].keys = &keys;
+        args[i].readPct = readPct;
+        args[i].seed = i + 1;
+        args[i].running = &running;
+        args[i].ops = 0;
+        if (pthread_create(&threads[i], NULL, worker, &args[i]) != 0) {
+            abort();
+        }
+    }
+    usleep(static_cast<useconds_t>(seconds * 1e6));
+    running = false;
+
+    size_t ops = 0;
+    for (int i = 0; i < nthreads; ++i) {
+        pthread_join(threads[i], NULL);
+        ops += args[i].ops;
+    }
+    double elapsed = now() - start;
+
+    printf("%-7s %3d threads %3d%% reads %8lu keys  %12.0f ops/s\n",
+           name, nthreads, readPct, static_cast<unsigned long>(nkeys),
+           ops / elapsed);
+}
+
+int main(int argc, char **argv) {
+    int nthreads = argc > 1 ? atoi(argv[1]) : 8;
+    int readPct = argc > 2 ? atoi(argv[2]) : 95;
+    size_t nkeys = argc > 3 ? strtoul(argv[3], NULL, 10) : 1000;
+    double seconds = argc > 4 ? atof(argv[4]) : 2.0;
+    assert(nthreads > 0 && nkeys > 0);
+
+    bench(HT_LOCK_MUTEX, nthreads, readPct, nkeys, seconds);
+    bench(HT_LOCK_RWLOCK, nthreads, readPct, nkeys, seconds);
+    return 0;
+}
@@ -1,7 +1,9 @@
 #include <signal.h>
 #include <assert.h>
+#include <pthread.h>
 
 #include <algorithm>
+#include <set>
 
 #include <ep.hh>
 #include <item.hh>
@@ -14,6 +16,10 @@ extern "C" {
     rel_time_t (*ep_current_time)() = basic_current_time;
 }
 
+// The bucket layout and stripe locks the tests are currently running against.
+static hash_table_layout_t layout = HT_CHAINED;
+static hash_table_lock_t lockType = HT_LOCK_MUTEX;
+
 class Counter : public HashTableVisitor {
 public:
 
@@ -77,7 +83,7 @@ static std::vector<std::string> generateKeys(int num, int start=0) {
 // ----------------------------------------------------------------------
 
 static void testHashSize() {
-    HashTable h;
+    HashTable h(DEFAULT_HT_SIZE, DEFAULT_HT_LOCKS, layout, lockType);
     assert(count(h) == 0);
 
     std::string k = "testkey";
@@ -87,7 +93,7 @@ static void testHashSize() {
 }
 
 static void testHashSizeTwo() {
-    HashTable h;
+    HashTable h(DEFAULT_HT_SIZE, DEFAULT_HT_LOCKS, layout, lockType);
     assert(count(h) == 0);
 
     std::vector<std::string> keys = generateKeys(5);
@@ -100,7 +106,7 @@ static void testHashSizeTwo() {
 
 static void testReverseDeletions() {
     alarm(10);
-    HashTable h(5, 1);
+    HashTable h(5, 1, layout, lockType);
     assert(count(h) == 0);
     const int nkeys = 10000;
 
@@ -121,7 +127,7 @@ static void testReverseDeletions() {
 
 static void testForwardDeletions() {
     alarm(10);
-    HashTable h(5, 1);
+    HashTable h(5, 1, layout, lockType);
     assert(count(h) == 0);
     const int nkeys = 10000;
 
@@ -139,7 +145,7 @@ static void testForwardDeletions() {
 }
 
 static void testFind() {
-    HashTable h(5, 1);
+    HashTable h(5, 1, layout, lockType);
     const int nkeys = 5000;
 
     std::vector<std::string> keys = generateKeys(nkeys);
@@ -156,7 +162,7 @@ static void testFind() {
 }
 
 static void testAdd() {
-    HashTable h(5, 1);
+    HashTable h(5, 1, layout, lockType);
     const int nkeys = 5000;
 
     std::vector<std::string> keys = generateKeys(nkeys);
@@ -178,8 +184,79 @@ static void testAdd() {
     }
 }
 
+static void testAddBatch() {
+    HashTable h(5, 7, layout, lockType);
+    const int nkeys = 5000;
+
+    std::vector<std::string> keys = generateKeys(nkeys);
+    // Half the keys are already there, with their own values.
+    std::vector<std::string> present(keys.begin(), keys.begin() + nkeys / 2);
+    addMany(h, present, true);
+    uint64_t casBefore = h.find(keys[0])->getCas();
+
+    std::vector<StoredValue*> batch;
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        value_t val(new std::string(*it + "\r\n"));
+        batch.push_back(StoredValue::create(it->data(), it->size(),
+                                            hashKey(*it), val, 3, 0));
+    }
+    assert(h.addBatch(batch) == static_cast<size_t>(nkeys - nkeys / 2));
+    assert(batch.empty());
+    assert(count(h) == nkeys);
+    assert(h.getNumItems() == static_cast<size_t>(nkeys));
+    assert(h.find(keys[0])->getCas() == casBefore);
+    assert(h.find(keys[0])->getFlags() == 0);
+
+    // The added values are clean, with their own CAS values.
+    std::set<uint64_t> cas;
+    for (it = keys.begin() + nkeys / 2; it != keys.end(); it++) {
+        StoredValue *v = h.find(*it);
+        assert(v);
+        assert(v->isClean());
+        assert(v->getFlags() == 3);
+        assert(v->getCas() > casBefore);
+        cas.insert(v->getCas());
+    }
+    assert(cas.size() == static_cast<size_t>(nkeys - nkeys / 2));
+}
+
+// Keeps keys whose last character is even.
+class EvenKeyFilter : public HashTableLoadFilter {
+public:
+    bool shouldAdd(const StoredValue *v) {
+        return (v->getKey()[v->getKeyLen() - 1] - '0') % 2 == 0;
+    }
+};
+
+static void testAddBatchFiltered() {
+    HashTable h(5, 7, layout, lockType);
+    const int nkeys = 1000;
+
+    std::vector<std::string> keys = generateKeys(nkeys);
+    std::vector<StoredValue*> batch;
+    std::vector<std::string>::iterator it;
+    for (it = keys.begin(); it != keys.end(); it++) {
+        // Keys only: the values stay on disk.
+        batch.push_back(StoredValue::create(it->data(), it->size(),
+                                            hashKey(*it), value_t(NULL),
+                                            0, 0));
+    }
+    EvenKeyFilter filter;
+    assert(h.addBatch(batch, &filter) == static_cast<size_t>(nkeys / 2));
+    assert(batch.empty());
+    assert(h.getNumItems() == static_cast<size_t>(nkeys / 2));
+    assert(h.getNumNonResident() == static_cast<size_t>(nkeys / 2));
+    for (it = keys.begin(); it != keys.end(); it++) {
+        StoredValue *v = h.find(*it);
+        bool even = ((*it)[it->size() - 1] - '0') % 2 == 0;
+        assert((v != NULL) == even);
+        assert(!v || !v->isResident());
+    }
+}
+
 static void testDepthCounting() {
-    HashTable h(5, 1);
+    HashTable h(5, 1, layout, lockType);
     const int nkeys = 5000;
 
     std::vector<std::string> keys = generateKeys(nkeys);
@@ -191,13 +268,378 @@ static void testDepthCounting() {
     assert(depthCounter.max > 1000);
 }
 
-int main() {
+static void testResize() {
+    HashTable h(5, 3, layout, lockType);
+    const int nkeys = 5000;
+
+    std::vector<std::string> keys = generateKeys(nkeys);
+    storeMany(h, keys);
+    assert(h.getTargetSize() > h.getSize());
+
+    assert(h.resize(h.getTargetSize()));
+    assert(h.isResizing());
+    assert(h.getSize() % 3 == 0);
+
+    // Everything must stay reachable while buckets are migrating.
+    std::vector<std::string>::iterator it;
+    while (h.resizeStep(7)) {
+        for (it = keys.begin(); it != keys.end(); it++) {
+            std::string key = *it;
+            assert(h.find(key));
+        }
+    }
+    assert(!h.isResizing());
+    assert(count(h) == nkeys);
+    assert(h.getNumItems() == (size_t)nkeys);
+
+    // Mutations during a resize land where lookups expect them.
+    std::vector<std::string> moreKeys = generateKeys(2 * nkeys, nkeys);
+    assert(h.resize(h.getSize() * 4));
+    h.resizeStep(1);
+    storeMany(h, moreKeys);
+    for (it = keys.begin(); it != keys.end(); it++) {
+        std::string key = *it;
+        assert(h.del(key));
+    }
+    while (h.resizeStep(1)) {
+    }
+    assert(count(h) == nkeys);
+    for (it = moreKeys.begin(); it != moreKeys.end(); it++) {
+        std::string key = *it;
+        assert(h.find(key));
+    }
+
+    // Shrinks back down once emptied, but never below its initial size.
+    h.clear();
+    assert(h.getNumItems() == 0);
+    assert(h.getTargetSize() < h.getSize());
+    assert(h.resize(h.getTargetSize()));
+    while (h.resizeStep(100)) {
+    }
+    assert(h.getSize() == 9);
+    assert(h.getNumResizes() == 3);
+}
+
+static void testEjection() {
+    HashTable h(5, 1, layout, lockType);
+    assert(h.getMemSize() == 0);
+
+    std::vector<std::string> keys = generateKeys(10);
+    addMany(h, keys, true);
+    size_t full = h.getMemSize();
+    assert(full > 0);
+
+    // Only clean values can be ejected.
+    std::string k = keys[0];
+    uint64_t hash = hashKey(k);
+    StoredValue *v = h.find(k);
+    assert(v);
+    value_t val = v->getValue();
+    {
+        StripeLockHolder lh(h.getStripeLock(hash));
+        v->reDirty(1, 1);
+        assert(!h.unlocked_ejectValue(v));
+        v->markClean(NULL, NULL);
+        // Nor while still queued: the write may not be committed.
+        v->setQueued(true);
+        assert(!h.unlocked_ejectValue(v));
+        v->setQueued(false);
+        assert(h.unlocked_ejectValue(v));
+        assert(!h.unlocked_ejectValue(v));
+    }
+    assert(!v->isResident());
+    assert(h.getNumNonResident() == 1);
+    assert(h.getMemSize() < full - val->length());
+
+    {
+        StripeLockHolder lh(h.getStripeLock(hash));
+        h.unlocked_restoreValue(v, val);
+    }
+    assert(v->isResident());
+    assert(h.getNumNonResident() == 0);
+    assert(h.getMemSize() == full);
+
+    // Setting an ejected item makes it resident again.
+    {
+        StripeLockHolder lh(h.getStripeLock(hash));
+        assert(h.unlocked_ejectValue(v));
+    }
+    store(h, k);
+    assert(v->isResident());
+    assert(h.getNumNonResident() == 0);
+    assert(h.getMemSize() == full);
+
+    // Deleting an ejected item forgets it entirely.
+    {
+        StripeLockHolder lh(h.getStripeLock(hash));
+        v->markClean(NULL, NULL);
+        assert(h.unlocked_ejectValue(v));
+    }
+    assert(h.del(k));
+    assert(h.getNumNonResident() == 0);
+    h.clear();
+    assert(h.getMemSize() == 0);
+}
+
+static void testMemAccounting() {
+    HashTable h(5, 1, layout, lockType);
+    assert(h.getKVSize() == 0);
+    assert(h.getOverhead() == 0);
+
+    std::vector<std::string> keys = generateKeys(1000);
+    storeMany(h, keys);
+    size_t kv = 0;
+    for (size_t i = 0; i < keys.size(); ++i) {
+        kv += keys[i].length() + h.find(keys[i])->getValue()->length();
+    }
+    assert(h.getKVSize() == kv);
+    assert(h.getOverhead() >= keys.size() * sizeof(StoredValue));
+    assert(h.getMemSize() == h.getKVSize() + h.getOverhead());
+
+    // Replacing a value swaps its bytes out of the kv size.
+    size_t overhead = h.getOverhead();
+    size_t oldLen = h.find(keys[0])->getValue()->length();
+    Item i(keys[0], 0, 0, "x", 1);
+    h.set(i);
+    size_t newLen = h.find(keys[0])->getValue()->length();
+    assert(newLen < oldLen);
+    assert(h.getKVSize() == kv - oldLen + newLen);
+
+    assert(h.del(keys[0]));
+    assert(h.getKVSize() == kv - oldLen - keys[0].length());
+    assert(h.getOverhead() < overhead);
+
+    h.clear();
+    assert(h.getKVSize() == 0);
+    assert(h.getOverhead() == 0);
+    assert(h.getMemSize() == 0);
+}
+
+static void testDirtySize() {
+    HashTable h(5, 1, layout, lockType);
+    std::vector<std::string> keys = generateKeys(3);
+    storeMany(h, keys);
+    assert(h.getDirtySize() == 0);
+
+    // Only queued values count, for as long as they're in the table.
+    StoredValue *v[2];
+    size_t queued = 0;
+    for (int i = 0; i < 2; ++i) {
+        v[i] = h.find(keys[i]);
+        StripeLockHolder lh(h.getStripeLock(v[i]->getHash()));
+        h.unlocked_setQueued(v[i], true);
+        h.unlocked_setQueued(v[i], true);
+        queued += v[i]->kvSize();
+    }
+    assert(h.getDirtySize() == queued);
+
+    // Replacing a queued value swaps its bytes.
+    size_t oldSize = v[0]->kvSize();
+    Item itm(keys[0], 0, 0, "x", 1);
+    h.set(itm);
+    queued = queued - oldSize + v[0]->kvSize();
+    assert(h.getDirtySize() == queued);
+
+    {
+        StripeLockHolder lh(h.getStripeLock(v[0]->getHash()));
+        h.unlocked_setQueued(v[0], false);
+    }
+    assert(h.getDirtySize() == v[1]->kvSize());
+
+    assert(h.del(keys[1]));
+    assert(h.getDirtySize() == 0);
+    StoredValue::destroy(v[1]);
+}
+
+static void testInlineKeys() {
+    HashTable h(5, 1, layout, lockType);
+
+    // Keys that are prefixes of each other, and keys too long for a
+    // string's inline buffer, must all be told apart.
+    std::vector<std::string> keys;
+    keys.push_back("");
+    keys.push_back("k");
+    keys.push_back("ke");
+    keys.push_back(std::string(300, 'k'));
+    keys.push_back(std::string(299, 'k'));
+    storeMany(h, keys);
+    assert(count(h) == static_cast<int>(keys.size()));
+    for (size_t i = 0; i < keys.size(); ++i) {
+        StoredValue *v = h.find(keys[i]);
+        assert(v);
+        assert(v->getKey() == keys[i]);
+        assert(v->hasKey(keys[i]));
+        assert(v->isDirty());
+    }
+    assert(h.getKVSize() >= 600);
+
+    // Locking and cleaning don't disturb each other.
+    StoredValue *v = h.find(keys[3]);
+    v->lock(10);
+    v->markClean(NULL, NULL);
+    assert(v->isLocked(5));
+    assert(v->isClean());
+    v->markDirty();
+    assert(v->isDirty());
+    assert(!v->isLocked(11));
+    assert(v->isDirty());
+
+    // Keys order bytewise, shorter prefixes first.
+    for (size_t i = 0; i < keys.size(); ++i) {
+        for (size_t j = 0; j < keys.size(); ++j) {
+            assert(h.find(keys[i])->keyLess(*h.find(keys[j]))
+                   == (keys[i] < keys[j]));
+        }
+    }
+}
+
+static void testReferenced() {
+    HashTable h(5, 1, layout, lockType);
+    std::vector<std::string> keys = generateKeys(2);
+    storeMany(h, keys);
+
+    // Storing an item doesn't count as using it.
+    StoredValue *v = h.find(keys[0]);
+    assert(!v->isReferenced());
+    assert(!h.find(keys[1])->isReferenced());
+
+    // The mark survives the other bits changing, and they it.
+    v->markReferenced();
+    v->lock(10);
+    v->markClean(NULL, NULL);
+    assert(v->isReferenced());
+    v->clearReferenced();
+    assert(!v->isReferenced());
+    assert(v->isLocked(5));
+    assert(v->isClean());
+    assert(!h.find(keys[1])->isReferenced());
+}
+
+static void testExpiry() {
+    HashTable h(5, 3, layout, lockType);
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+
+    // Walking the stripes one by one visits every item once.
+    Counter c;
+    for (size_t i = 0; i < h.getNumLocks(); ++i) {
+        h.visitStripe(i, c);
+    }
+    assert(c.count == static_cast<int>(keys.size()));
+
+    std::string k("expiring");
+    Item i(k, 0, 10, "v", 1);
+    h.set(i);
+    StoredValue *v = h.find(k);
+    assert(v);
+    assert(!v->isExpired(9));
+    assert(v->isExpired(10));
+    assert(!h.find(keys[0])->isExpired(1000));
+
+    {
+        uint64_t hash = hashKey(k);
+        StripeLockHolder lh(h.getStripeLock(hash));
+        assert(h.unlocked_del(k, hash));
+        assert(!h.unlocked_del(k, hash));
+    }
+    assert(h.getNumItems() == keys.size());
+}
+
+static void testQueuedDelete() {
+    HashTable h(5, 1, layout, lockType);
+    std::vector<std::string> keys = generateKeys(2);
+    storeMany(h, keys);
+
+    // A queued value outlives its removal from the table, so the
+    // queue can still tell the delete apart from a new value.
+    StoredValue *queued[2];
+    for (int i = 0; i < 2; ++i) {
+        queued[i] = h.find(keys[i]);
+        queued[i]->setQueued(true);
+    }
+    assert(h.del(keys[0]));
+    assert(!h.find(keys[0]));
+    assert(queued[0]->isDeleted());
+    assert(queued[0]->getKey() == keys[0]);
+
+    store(h, keys[0]);
+    StoredValue *v = h.find(keys[0]);
+    assert(v != queued[0]);
+    assert(!v->isQueued());
+    assert(!v->isDeleted());
+
+    h.clear();
+    assert(h.getNumItems() == 0);
+    assert(queued[1]->isDeleted());
+    StoredValue::destroy(queued[0]);
+    StoredValue::destroy(queued[1]);
+}
+
+extern "C" {
+    static void *lockStripe(void *arg) {
+        HashStripeLock *l = static_cast<HashStripeLock*>(arg);
+        StripeLockHolder lh(*l);
+        return NULL;
+    }
+}
+
+static void testLockStats() {
+    HashTable h(5, 3, layout, lockType);
+    assert(h.getNumLocks() == 3);
+
+    std::vector<std::string> keys = generateKeys(100);
+    storeMany(h, keys);
+    size_t acquisitions = 0;
+    for (size_t i = 0; i < h.getNumLocks(); ++i) {
+        acquisitions += h.getStripe(i).getAcquisitions();
+        assert(h.getStripe(i).getContended() == 0);
+    }
+    assert(acquisitions >= keys.size());
+
+    // A second thread has to wait for a stripe we're holding.
+    uint64_t hash = hashKey(keys[0]);
+    HashStripeLock &l = h.getStripeLock(hash);
+    pthread_t tid;
+    {
+        StripeLockHolder lh(l);
+        assert(pthread_create(&tid, NULL, lockStripe, &l) == 0);
+        usleep(10000);
+    }
+    assert(pthread_join(tid, NULL) == 0);
+    assert(l.getContended() == 1);
+    assert(l.getWaitTime() > 0);
+}
+
+static void runTests() {
     testHashSize();
     testHashSizeTwo();
     testReverseDeletions();
     testForwardDeletions();
     testFind();
     testAdd();
+    testAddBatch();
+    testAddBatchFiltered();
     testDepthCounting();
+    testResize();
+    testLockStats();
+    testEjection();
+    testMemAccounting();
+    testDirtySize();
+    testInlineKeys();
+    testReferenced();
+    testExpiry();
+    testQueuedDelete();
+}
+
+int main() {
+    layout = HT_CHAINED;
+    runTests();
+    layout = HT_TAGGED;
+    runTests();
+    lockType = HT_LOCK_RWLOCK;
+    layout = HT_CHAINED;
+    runTests();
+    layout = HT_TAGGED;
+    runTests();
     exit(0);
 }
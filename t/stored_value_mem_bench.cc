@@ -0,0 +1,75 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Measure the memory cost of each item in the hash table.
+ *
+ * Usage: stored_value_mem_bench [nkeys [keylen [vallen]]]
+ *
+ * Inserts nkeys (default 1M) items with keys of about keylen bytes
+ * (default 10) and values of vallen bytes (default 8), then reports
+ * the bytes per item the table accounts for and the bytes per item
+ * the process actually grew by.  The table is sized up front so that
+ * resizing doesn't skew the numbers.
+ */
+#include <sys/resource.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ep.hh>
+#include <item.hh>
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+// Peak resident set size of the process in bytes.
+static size_t maxRSS() {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+#ifdef __APPLE__
+    return ru.ru_maxrss;
+#else
+    return ru.ru_maxrss * 1024;
+#endif
+}
+
+int main(int argc, char **argv) {
+    size_t nkeys = argc > 1 ? strtoul(argv[1], NULL, 10) : 1000000;
+    size_t keylen = argc > 2 ? strtoul(argv[2], NULL, 10) : 10;
+    size_t vallen = argc > 3 ? strtoul(argv[3], NULL, 10) : 8;
+    assert(nkeys > 0 && keylen > 0 && keylen < 250);
+
+    std::string val(vallen, 'v');
+    HashTable *h = new HashTable(nkeys, DEFAULT_HT_LOCKS);
+
+    size_t before = maxRSS();
+    for (size_t i = 0; i < nkeys; ++i) {
+        char buf[256];
+        snprintf(buf, sizeof(buf), "%0*lu", static_cast<int>(keylen),
+                 static_cast<unsigned long>(i));
+        Item itm(std::string(buf), 0, 0, val.data(), val.length());
+        h->set(itm);
+    }
+    size_t after = maxRSS();
+
+    printf("sizeof(StoredValue) %lu\n",
+           static_cast<unsigned long>(sizeof(StoredValue)));
+    printf("%lu items, %lu byte keys, %lu byte values\n",
+           static_cast<unsigned long>(nkeys),
+           static_cast<unsigned long>(keylen),
+           static_cast<unsigned long>(vallen));
+    printf("mem_used     %8.1f bytes/item\n",
+           static_cast<double>(h->getMemSize()) / nkeys);
+    printf("ep_kv_size   %8.1f bytes/item\n",
+           static_cast<double>(h->getKVSize()) / nkeys);
+    printf("ep_overhead  %8.1f bytes/item\n",
+           static_cast<double>(h->getOverhead()) / nkeys);
+    printf("process RSS  %8.1f bytes/item\n",
+           static_cast<double>(after - before) / nkeys);
+
+    delete h;
+    return 0;
+}
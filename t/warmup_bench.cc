@@ -0,0 +1,151 @@
+/* -*- Mode: C++; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Compare loading the hash table from the store an item at a time
+ * with the bulk path warmup uses.
+ *
+ * Usage: warmup_bench [rows [dbname]]
+ *
+ * Fills a sharded database (default /tmp/warmup_bench.db) with rows
+ * rows (default 10M), then alternately loads them all into an empty
+ * hash table through dump() and HashTable::add(), as warmup used to,
+ * and through dumpRows() and HashTable::addBatch(), reporting rows per
+ * second for each.  Everything runs on one thread, so this measures
+ * what each path costs rather than lock contention.  Any existing
+ * database of that name is replaced.
+ */
+#include <sys/time.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <ep.hh>
+#include <item.hh>
+#include <sqlite-kvstore.hh>
+#include <sqlite-strategies.hh>
+
+#define NUM_SHARDS 4
+#define ROUNDS 2
+
+extern "C" {
+    static rel_time_t basic_current_time(void) {
+        return 0;
+    }
+
+    rel_time_t (*ep_current_time)() = basic_current_time;
+}
+
+static void quietLog(EXTENSION_LOG_LEVEL, const void *, const char *, ...) {
+}
+
+static EXTENSION_LOGGER_DESCRIPTOR quietLogger = { NULL, quietLog };
+
+EXTENSION_LOGGER_DESCRIPTOR *getLogger(void) {
+    return &quietLogger;
+}
+
+class IgnoreCallback : public Callback<bool> {
+public:
+    void callback(bool &) { }
+};
+
+// Loads each item the way warmup did before the bulk path.
+class AddCallback : public Callback<GetValue> {
+public:
+    AddCallback(HashTable &h) : ht(h) { }
+    void callback(GetValue &gv) {
+        Item *i = gv.getValue();
+        ht.add(*i, true);
+        delete i;
+    }
+private:
+    HashTable &ht;
+};
+
+class IgnoreRowCallback : public Callback<DumpedRow> {
+public:
+    void callback(DumpedRow &) { }
+};
+
+static double now() {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static void preload(KVStore *kv, size_t rows, const std::string &value) {
+    IgnoreCallback cb;
+    double start = now();
+    kv->begin();
+    for (size_t i = 0; i < rows; ++i) {
+        if (i % 100000 == 0) {
+            kv->commit();
+            kv->begin();
+        }
+        char key[32];
+        snprintf(key, sizeof(key), "key:%010lu", static_cast<unsigned long>(i));
+        Item itm(std::string(key), 0, 0, value.data(), value.length());
+        kv->set(itm, cb);
+    }
+    kv->commit();
+    printf("preloaded %lu rows in %.1fs\n",
+           static_cast<unsigned long>(rows), now() - start);
+}
+
+static void bench(KVStore *kv, size_t rows, bool bulk) {
+    // Sized up front, as a restarted server's table would have grown
+    // to about this, so that resizing doesn't skew the numbers.
+    HashTable *h = new HashTable(rows, DEFAULT_HT_LOCKS);
+    double start = now();
+    if (bulk) {
+        EPStats stats;
+        Atomic<size_t> loaded(0);
+        LoadStorageKVPairCallback cb(*h, stats, loaded);
+        kv->dumpRows(cb);
+        cb.flush();
+    } else {
+        AddCallback cb(*h);
+        kv->dump(cb);
+    }
+    double elapsed = now() - start;
+    assert(h->getNumItems() == rows);
+
+    printf("%-8s %9.0f rows/s  %7.2fs\n", bulk ? "bulk" : "per-item",
+           rows / elapsed, elapsed);
+    delete h;
+}
+
+int main(int argc, char **argv) {
+    size_t rows = argc > 1 ? strtoul(argv[1], NULL, 10) : 10000000;
+    std::string dbname = argc > 2 ? argv[2] : "/tmp/warmup_bench.db";
+    std::string value(100, 'v');
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    // Open the database once to learn its shard files, then start
+    // over without them.
+    MultiDBSqliteStrategy *strategy =
+        new MultiDBSqliteStrategy(dbname.c_str(), NULL, NUM_SHARDS);
+    std::vector<std::string> files;
+    for (int i = 0; i < NUM_SHARDS; ++i) {
+        files.push_back(strategy->shardFile(i));
+    }
+    delete strategy;
+    remove(dbname.c_str());
+    for (int i = 0; i < NUM_SHARDS; ++i) {
+        remove(files[i].c_str());
+    }
+
+    StrategicSqlite3 *kv = new StrategicSqlite3(
+        new MultiDBSqliteStrategy(dbname.c_str(), NULL, NUM_SHARDS));
+    preload(kv, rows, value);
+
+    // Read everything once so neither path pays to fill the cache.
+    IgnoreRowCallback ignore;
+    kv->dumpRows(ignore);
+
+    for (int r = 0; r < ROUNDS; ++r) {
+        bench(kv, rows, false);
+        bench(kv, rows, true);
+    }
+
+    delete kv;
+    return 0;
+}